@@ -0,0 +1,662 @@
+/**
+ * @file bench.c
+ * @author Vikman Fernandez-Castro (victor@wazuh.com)
+ * @brief RB tree benchmark suite
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2019 Wazuh, Inc.
+ */
+
+/*
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "rbtree.h"
+
+#define KEY_SIZE 17
+
+/// Output formats
+typedef enum bench_format { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON } bench_format;
+
+/// Benchmark settings
+typedef struct bench_config {
+    unsigned n;                 ///< Number of keys loaded before measuring
+    unsigned ops;               ///< Number of measured operations
+    unsigned batch;             ///< Operations per timed batch
+    unsigned range;             ///< Keys per range scan
+    int pooled;                 ///< Use the pooled allocator
+    int relayout;               ///< Relayout the tree after loading it
+    int u64;                    ///< Use uint64_t keys instead of strings
+    uint64_t seed;              ///< Random seed
+    bench_format format;        ///< Output format
+} bench_config;
+
+/// Benchmark state shared by all workloads
+typedef struct bench_ctx {
+    const bench_config * config;    ///< Settings
+    char * keys;                    ///< Key strings, KEY_SIZE bytes each
+    unsigned nkeys;                 ///< Number of keys in the keys buffer
+    double * samples;               ///< ns/op of every batch
+    unsigned nsamples;              ///< Number of samples
+    unsigned ops;                   ///< Number of measured operations
+    uint64_t state;                 ///< Random generator state
+    unsigned long checksum;         ///< Sink for results, so work is not optimized out
+    rb_iter iter;                   ///< Cursor of the scan workload
+    rb_hint hint;                   ///< Hint of the seq-hint workload
+} bench_ctx;
+
+/// Benchmark result
+typedef struct bench_result {
+    const char * workload;      ///< Workload name
+    unsigned ops;               ///< Number of operations
+    double mean;                ///< Mean ns/op over batches
+    double p50;                 ///< Median ns/op per batch
+    double p99;                 ///< 99th percentile ns/op per batch
+    double p999;                ///< 99.9th percentile ns/op per batch
+} bench_result;
+
+/// Workload definition
+typedef struct bench_workload {
+    const char * name;                      ///< Workload name
+    void (*run)(bench_ctx * ctx);           ///< Function to run the workload
+} bench_workload;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Get a pseudo-random number (xorshift64*)
+ *
+ * @param ctx Pointer to the benchmark state.
+ * @return 64-bit pseudo-random number.
+ */
+
+static uint64_t next_random(bench_ctx * ctx) {
+    ctx->state ^= ctx->state >> 12;
+    ctx->state ^= ctx->state << 25;
+    ctx->state ^= ctx->state >> 27;
+    return ctx->state * 2685821657736338717ULL;
+}
+
+/**
+ * @brief Get the key string for a key number
+ *
+ * Keys are fixed-width hexadecimal numbers, so their order matches the
+ * numeric order of their identifiers. In uint64_t mode, the slot holds the
+ * identifier itself.
+ *
+ * @param ctx Pointer to the benchmark state.
+ * @param i Key number.
+ * @return Pointer to the key string.
+ */
+
+static const char * key_at(const bench_ctx * ctx, unsigned i) {
+    return ctx->keys + (size_t)i * KEY_SIZE;
+}
+
+/**
+ * @brief Fill the key buffer
+ *
+ * @param ctx Pointer to the benchmark state.
+ * @param n Number of keys.
+ * @param scattered If nonzero, key numbers are hashed so that consecutive
+ *                  keys are far apart in key order.
+ */
+
+static void make_keys(bench_ctx * ctx, unsigned n, int scattered) {
+    free(ctx->keys);
+    ctx->keys = malloc((size_t)n * KEY_SIZE);
+    ctx->nkeys = n;
+
+    for (unsigned i = 0; i < n; i++) {
+        uint64_t id = scattered ? (uint64_t)i * 0x9E3779B97F4A7C15ULL : i;
+
+        if (ctx->config->u64) {
+            memcpy(ctx->keys + (size_t)i * KEY_SIZE, &id, sizeof(id));
+        } else {
+            snprintf(ctx->keys + (size_t)i * KEY_SIZE, KEY_SIZE, "%016llx", (unsigned long long)id);
+        }
+    }
+}
+
+/**
+ * @brief Create a tree with the configured allocator and key type
+ *
+ * @param ctx Pointer to the benchmark state.
+ * @return Pointer to an empty tree.
+ */
+
+static rb_tree * new_tree(const bench_ctx * ctx) {
+    rb_tree * tree = ctx->config->pooled ? rbtree_init_pooled() : rbtree_init();
+
+    if (ctx->config->u64) {
+        rbtree_set_key_type(tree, RB_KEY_U64, 0);
+    }
+
+    return tree;
+}
+
+/**
+ * @brief Load the first n keys into a tree
+ *
+ * The tree is then relaid out, if configured, before it is measured.
+ *
+ * @param ctx Pointer to the benchmark state.
+ * @param tree Pointer to a red-black tree.
+ * @param n Number of keys.
+ */
+
+static void load_keys(const bench_ctx * ctx, rb_tree * tree, unsigned n) {
+    for (unsigned i = 0; i < n; i++) {
+        rbtree_insert(tree, key_at(ctx, i), (void *)key_at(ctx, i));
+    }
+
+    if (ctx->config->relayout) {
+        rbtree_relayout(tree);
+    }
+}
+
+/**
+ * @brief Record the time of a batch
+ *
+ * @param ctx Pointer to the benchmark state.
+ * @param start Batch start time, in nanoseconds.
+ * @param ops Number of operations in the batch.
+ */
+
+static void record(bench_ctx * ctx, double start, unsigned ops) {
+    ctx->samples[ctx->nsamples++] = (now_ns() - start) / ops;
+    ctx->ops += ops;
+}
+
+/**
+ * @brief Run a measured loop in timed batches
+ *
+ * @param ctx Pointer to the benchmark state.
+ * @param op Function to run operation i.
+ * @param tree Pointer to the tree under test.
+ */
+
+static void run_batches(bench_ctx * ctx, void (*op)(bench_ctx *, rb_tree *, unsigned), rb_tree * tree) {
+    unsigned ops = ctx->config->ops;
+    unsigned batch = ctx->config->batch;
+
+    for (unsigned i = 0; i < ops; i += batch) {
+        unsigned end = i + batch < ops ? i + batch : ops;
+        double start = now_ns();
+
+        for (unsigned j = i; j < end; j++) {
+            op(ctx, tree, j);
+        }
+
+        record(ctx, start, end - i);
+    }
+}
+
+/* Operations *****************************************************************/
+
+static void op_insert(bench_ctx * ctx, rb_tree * tree, unsigned i) {
+    ctx->checksum += rbtree_insert(tree, key_at(ctx, i), (void *)key_at(ctx, i)) != NULL;
+}
+
+static void op_get_random(bench_ctx * ctx, rb_tree * tree, unsigned i) {
+    (void)i;
+    ctx->checksum += rbtree_get(tree, key_at(ctx, next_random(ctx) % ctx->config->n)) != NULL;
+}
+
+static void op_get_sequential(bench_ctx * ctx, rb_tree * tree, unsigned i) {
+    ctx->checksum += rbtree_get(tree, key_at(ctx, i % ctx->config->n)) != NULL;
+}
+
+static void op_get_hint(bench_ctx * ctx, rb_tree * tree, unsigned i) {
+    ctx->checksum += rbtree_get_hint(tree, key_at(ctx, i % ctx->config->n), &ctx->hint) != NULL;
+}
+
+/// Cumulative distribution of Zipf ranks
+static double * zipf_cdf;
+
+/**
+ * @brief Prepare a Zipf distribution over n ranks
+ *
+ * @param n Number of ranks.
+ * @param theta Skew exponent.
+ */
+
+static void zipf_init(unsigned n, double theta) {
+    double sum = 0;
+    zipf_cdf = realloc(zipf_cdf, n * sizeof(double));
+
+    for (unsigned i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, theta);
+        zipf_cdf[i] = sum;
+    }
+
+    for (unsigned i = 0; i < n; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+/**
+ * @brief Draw a Zipf-distributed rank
+ *
+ * @param ctx Pointer to the benchmark state.
+ * @return Rank in [0, n).
+ */
+
+static unsigned zipf_next(bench_ctx * ctx) {
+    double u = (next_random(ctx) >> 11) * (1.0 / 9007199254740992.0);
+    unsigned lo = 0;
+    unsigned hi = ctx->config->n - 1;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void op_get_zipf(bench_ctx * ctx, rb_tree * tree, unsigned i) {
+    (void)i;
+    // Scatter ranks across the key space, so hot keys are not neighbours
+    unsigned rank = zipf_next(ctx);
+    ctx->checksum += rbtree_get(tree, key_at(ctx, (unsigned)(rank * 2654435761u) % ctx->config->n)) != NULL;
+}
+
+static void op_delete_insert(bench_ctx * ctx, rb_tree * tree, unsigned i) {
+    (void)i;
+    const char * key = key_at(ctx, next_random(ctx) % ctx->config->n);
+
+    if (!rbtree_delete(tree, key)) {
+        rbtree_insert(tree, key, (void *)key);
+    }
+}
+
+static void op_mixed(bench_ctx * ctx, rb_tree * tree, unsigned i) {
+    (void)i;
+    uint64_t r = next_random(ctx);
+    const char * key = key_at(ctx, (r >> 8) % ctx->nkeys);
+
+    if (r % 10 != 0) {
+        ctx->checksum += rbtree_get(tree, key) != NULL;
+    } else {
+        rbtree_upsert(tree, key, (void *)key);
+    }
+}
+
+static int visit(const char * key, void * value, void * ctx) {
+    (void)key;
+    *(unsigned long *)ctx += (uintptr_t)value & 1;
+    return 0;
+}
+
+static void op_range(bench_ctx * ctx, rb_tree * tree, unsigned i) {
+    (void)i;
+    unsigned first = next_random(ctx) % ctx->config->n;
+    unsigned last = first + ctx->config->range - 1;
+
+    if (last >= ctx->config->n) {
+        last = ctx->config->n - 1;
+    }
+
+    rbtree_foreach_range(tree, key_at(ctx, first), key_at(ctx, last), visit, &ctx->checksum);
+}
+
+static void op_scan(bench_ctx * ctx, rb_tree * tree, unsigned i) {
+    const char * key = i ? rbtree_iter_next(&ctx->iter) : NULL;
+
+    if (key == NULL) {
+        key = rbtree_iter_first(tree, &ctx->iter);
+    }
+
+    ctx->checksum += (uintptr_t)rbtree_iter_value(&ctx->iter) & 1;
+}
+
+/* Workloads ******************************************************************/
+
+// Insert keys in ascending order
+
+static void run_seq_insert(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->ops, 0);
+    rb_tree * tree = new_tree(ctx);
+    run_batches(ctx, op_insert, tree);
+    rbtree_destroy(tree);
+}
+
+// Look up keys in ascending order
+
+static void run_seq_get(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->n, 0);
+    rb_tree * tree = new_tree(ctx);
+    load_keys(ctx, tree, ctx->config->n);
+    run_batches(ctx, op_get_sequential, tree);
+    rbtree_destroy(tree);
+}
+
+// Look up keys in ascending order, each one starting from the previous one
+
+static void run_seq_hint(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->n, 0);
+    rb_tree * tree = new_tree(ctx);
+    load_keys(ctx, tree, ctx->config->n);
+    ctx->hint.node = NULL;
+    run_batches(ctx, op_get_hint, tree);
+    rbtree_destroy(tree);
+}
+
+// Insert scattered keys
+
+static void run_rand_insert(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->ops, 1);
+    rb_tree * tree = new_tree(ctx);
+    run_batches(ctx, op_insert, tree);
+    rbtree_destroy(tree);
+}
+
+// Look up uniformly random keys
+
+static void run_rand_get(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->n, 1);
+    rb_tree * tree = new_tree(ctx);
+    load_keys(ctx, tree, ctx->config->n);
+    run_batches(ctx, op_get_random, tree);
+    rbtree_destroy(tree);
+}
+
+// Look up keys with Zipf-skewed popularity
+
+static void run_zipf(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->n, 1);
+    zipf_init(ctx->config->n, 0.99);
+    rb_tree * tree = new_tree(ctx);
+    load_keys(ctx, tree, ctx->config->n);
+    run_batches(ctx, op_get_zipf, tree);
+    rbtree_destroy(tree);
+}
+
+// Delete random keys, reinserting those that were already deleted
+
+static void run_delete(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->n, 1);
+    rb_tree * tree = new_tree(ctx);
+    load_keys(ctx, tree, ctx->config->n);
+    run_batches(ctx, op_delete_insert, tree);
+    rbtree_destroy(tree);
+}
+
+// 90% lookups, 10% upserts, over a key space twice the tree size
+
+static void run_mixed(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->n * 2, 1);
+    rb_tree * tree = new_tree(ctx);
+    load_keys(ctx, tree, ctx->config->n);
+    run_batches(ctx, op_mixed, tree);
+    rbtree_destroy(tree);
+}
+
+// Visit short ranges starting at random keys
+
+static void run_range(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->n, 0);
+    rb_tree * tree = new_tree(ctx);
+    load_keys(ctx, tree, ctx->config->n);
+    run_batches(ctx, op_range, tree);
+    rbtree_destroy(tree);
+}
+
+// Step an iterator over the whole tree, one key per operation
+
+static void run_scan(bench_ctx * ctx) {
+    make_keys(ctx, ctx->config->n, 1);
+    rb_tree * tree = new_tree(ctx);
+    load_keys(ctx, tree, ctx->config->n);
+    run_batches(ctx, op_scan, tree);
+    rbtree_destroy(tree);
+}
+
+// Copy all the keys with rbtree_keys, timed per key
+
+static void run_keys(bench_ctx * ctx) {
+    unsigned n = ctx->config->n;
+
+    make_keys(ctx, n, 1);
+    rb_tree * tree = new_tree(ctx);
+    load_keys(ctx, tree, n);
+
+    do {
+        double start = now_ns();
+        char ** keys = rbtree_keys(tree);
+        record(ctx, start, n);
+
+        for (unsigned i = 0; i < n; i++) {
+            ctx->checksum += keys[i][0];
+            free(keys[i]);
+        }
+
+        free(keys);
+    } while (ctx->ops + n <= ctx->config->ops && ctx->nsamples * ctx->config->batch < ctx->config->ops);
+
+    rbtree_destroy(tree);
+}
+
+static const bench_workload WORKLOADS[] = {
+    { "seq-insert", run_seq_insert },
+    { "seq-get", run_seq_get },
+    { "seq-hint", run_seq_hint },
+    { "rand-insert", run_rand_insert },
+    { "rand-get", run_rand_get },
+    { "zipf", run_zipf },
+    { "delete", run_delete },
+    { "mixed", run_mixed },
+    { "range", run_range },
+    { "scan", run_scan },
+    { "keys", run_keys },
+};
+
+#define NWORKLOADS (sizeof(WORKLOADS) / sizeof(WORKLOADS[0]))
+
+/* Reporting ******************************************************************/
+
+static int cmp_double(const void * a, const void * b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Get a percentile from sorted samples
+ *
+ * @param samples Sorted array of samples.
+ * @param n Number of samples.
+ * @param p Percentile, in [0, 1].
+ * @return Nearest-rank percentile.
+ */
+
+static double percentile(const double * samples, unsigned n, double p) {
+    unsigned i = (unsigned)ceil(p * n);
+    return samples[i > 0 ? i - 1 : 0];
+}
+
+/**
+ * @brief Summarize the samples of a workload
+ *
+ * @param ctx Pointer to the benchmark state.
+ * @param name Workload name.
+ * @return Benchmark result.
+ */
+
+static bench_result summarize(bench_ctx * ctx, const char * name) {
+    bench_result result = { name, 0, 0, 0, 0, 0 };
+    unsigned n = ctx->nsamples;
+
+    if (n == 0) {
+        return result;
+    }
+
+    qsort(ctx->samples, n, sizeof(double), cmp_double);
+
+    for (unsigned i = 0; i < n; i++) {
+        result.mean += ctx->samples[i];
+    }
+
+    result.ops = ctx->ops;
+    result.mean /= n;
+    result.p50 = percentile(ctx->samples, n, 0.5);
+    result.p99 = percentile(ctx->samples, n, 0.99);
+    result.p999 = percentile(ctx->samples, n, 0.999);
+    return result;
+}
+
+static void print_header(const bench_config * config) {
+    switch (config->format) {
+    case FORMAT_TEXT:
+        printf("%-12s %10s %10s %10s %10s %10s\n", "workload", "ops", "ns/op", "p50", "p99", "p999");
+        break;
+    case FORMAT_CSV:
+        printf("workload,allocator,key_type,keys,ops,batch,ns_op,p50,p99,p999\n");
+        break;
+    case FORMAT_JSON:
+        printf("[\n");
+    }
+}
+
+static void print_result(const bench_config * config, const bench_result * r, int first) {
+    const char * allocator = config->relayout ? "veb" : config->pooled ? "pool" : "malloc";
+    const char * key_type = config->u64 ? "u64" : "string";
+
+    switch (config->format) {
+    case FORMAT_TEXT:
+        printf("%-12s %10u %10.1f %10.1f %10.1f %10.1f\n", r->workload, r->ops, r->mean, r->p50, r->p99, r->p999);
+        break;
+    case FORMAT_CSV:
+        printf("%s,%s,%s,%u,%u,%u,%.1f,%.1f,%.1f,%.1f\n", r->workload, allocator, key_type, config->n, r->ops, config->batch, r->mean, r->p50, r->p99, r->p999);
+        break;
+    case FORMAT_JSON:
+        printf("%s  {\"workload\": \"%s\", \"allocator\": \"%s\", \"key_type\": \"%s\", \"keys\": %u, \"ops\": %u, \"batch\": %u, \"ns_op\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}", first ? "" : ",\n", r->workload, allocator, key_type, config->n, r->ops, config->batch, r->mean, r->p50, r->p99, r->p999);
+    }
+}
+
+static void print_footer(const bench_config * config) {
+    if (config->format == FORMAT_JSON) {
+        printf("\n]\n");
+    }
+}
+
+static void usage(const char * argv0) {
+    fprintf(stderr, "Syntax: %s [-n keys] [-o ops] [-b batch] [-r range] [-s seed] [-p] [-l] [-u] [-f text|csv|json] [workload...]\n", argv0);
+    fprintf(stderr, "Workloads:");
+
+    for (unsigned i = 0; i < NWORKLOADS; i++) {
+        fprintf(stderr, " %s", WORKLOADS[i].name);
+    }
+
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char ** argv) {
+    bench_config config = { 1000000, 1000000, 1000, 100, 0, 0, 0, 0x2545F4914F6CDD1DULL, FORMAT_TEXT };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:o:b:r:s:pluf:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            config.n = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            config.ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            config.batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            config.range = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            config.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            config.pooled = 1;
+            break;
+        case 'l':
+            config.relayout = 1;
+            break;
+        case 'u':
+            config.u64 = 1;
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                config.format = FORMAT_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                config.format = FORMAT_JSON;
+            } else if (strcmp(optarg, "text") == 0) {
+                config.format = FORMAT_TEXT;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (config.n == 0 || config.ops == 0 || config.batch == 0 || config.range == 0 || config.seed == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    bench_ctx ctx = { &config, NULL, 0, NULL, 0, 0, config.seed, 0, { NULL, NULL, 0 }, { NULL, 0 } };
+    ctx.samples = malloc(sizeof(double) * (config.ops / config.batch + 1));
+    int first = 1;
+
+    print_header(&config);
+
+    for (unsigned i = 0; i < NWORKLOADS; i++) {
+        int selected = optind == argc;
+
+        for (int j = optind; j < argc && !selected; j++) {
+            selected = strcmp(argv[j], WORKLOADS[i].name) == 0;
+        }
+
+        if (!selected) {
+            continue;
+        }
+
+        ctx.nsamples = 0;
+        ctx.ops = 0;
+        WORKLOADS[i].run(&ctx);
+        bench_result result = summarize(&ctx, WORKLOADS[i].name);
+        print_result(&config, &result, first);
+        first = 0;
+        fflush(stdout);
+    }
+
+    print_footer(&config);
+    fprintf(stderr, "Checksum: %lu\n", ctx.checksum);
+
+    free(ctx.samples);
+    free(ctx.keys);
+    free(zipf_cdf);
+    return EXIT_SUCCESS;
+}
@@ -20,12 +20,116 @@
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include "rbtree.h"
 
 double time_diff(const struct timespec * a, const struct timespec * b) {
     return b->tv_sec - a->tv_sec + (b->tv_nsec - a->tv_nsec) / 1e9;
 }
 
+int count_visit(const char * key, void * value, void * ctx) {
+    (void)key;
+    (void)value;
+    return --*(int *)ctx == 0;
+}
+
+int count_parallel(const char * key, void * value, void * ctx) {
+    (void)value;
+    __atomic_add_fetch((int *)ctx, 1, __ATOMIC_RELAXED);
+    return strcmp(key, "~") == 0 ? 7 : 0;
+}
+
+int scan_visit(const char * key, void * value, void * ctx) {
+    (void)value;
+    (void)ctx;
+    return key[0] == '\0';
+}
+
+/// Keys folded by rbtree_map_reduce
+typedef struct key_span {
+    const char * first;         ///< Lowest key
+    const char * last;          ///< Highest key
+    int count;                  ///< Number of keys
+} key_span;
+
+void * span_map(const char * key, void * value, void * acc, void * ctx) {
+    key_span * span = acc;
+    (void)value;
+    (void)ctx;
+
+    if (span == NULL) {
+        span = malloc(sizeof(key_span));
+        span->first = key;
+        span->count = 0;
+    } else {
+        assert(strcmp(span->last, key) < 0);
+    }
+
+    span->last = key;
+    span->count++;
+    return span;
+}
+
+void * span_reduce(void * left, void * right, void * ctx) {
+    key_span * l = left;
+    key_span * r = right;
+    (void)ctx;
+
+    assert(strcmp(l->last, r->first) < 0);
+    l->last = r->last;
+    l->count += r->count;
+    free(r);
+    return l;
+}
+
+int count_diff(rb_diff change, const char * key, void * old_value, void * new_value, void * ctx) {
+    (void)key;
+    assert(change == RB_DIFF_ADDED ? old_value == NULL : change == RB_DIFF_REMOVED ? new_value == NULL : old_value != new_value);
+    ((int *)ctx)[change]++;
+    return 0;
+}
+
+int numeric_compare(const char * a, const char * b) {
+    long long x = atoll(a);
+    long long y = atoll(b);
+    return (x > y) - (x < y);
+}
+
+void * string_copy(const void * string) {
+    return strdup(string);
+}
+
+size_t string_size(const void * string) {
+    return strlen(string) + 1;
+}
+
+int string_equal(const void * a, const void * b) {
+    return strcmp(a, b) == 0;
+}
+
+void check_order(const rb_tree * tree) {
+    unsigned i = 0;
+    rb_iter it;
+
+    for (const char * key = rbtree_iter_first(tree, &it); key != NULL; key = rbtree_iter_next(&it), i++) {
+        assert(key == rbtree_select(tree, i));
+    }
+
+    assert(i == rbtree_size(tree));
+
+    for (const char * key = rbtree_iter_last(tree, &it); key != NULL; key = rbtree_iter_prev(&it)) {
+        i--;
+        assert(key == rbtree_select(tree, i));
+    }
+
+    assert(i == 0);
+}
+
 void matrix_free(char ** matrix, int n) {
     for (int i = 0; i < n; i++) {
         free(matrix[i]);
@@ -34,14 +138,346 @@ void matrix_free(char ** matrix, int n) {
     free(matrix);
 }
 
+/**
+ * @brief Open a hardware cache-miss counter for this thread
+ *
+ * @return File descriptor of the counter.
+ * @retval -1 Performance counters are not available.
+ */
+
+int cache_misses_open() {
+    struct perf_event_attr attr = { .type = PERF_TYPE_HARDWARE, .size = sizeof(attr), .config = PERF_COUNT_HW_CACHE_MISSES, .disabled = 1, .exclude_kernel = 1, .exclude_hv = 1 };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * @brief Measure lookups on a tree with n keys
+ *
+ * Keys are 16-character hexadecimal strings. Every key is looked up once in a
+ * shuffled order, and the time and cache misses per lookup are printed.
+ *
+ * @param n Number of keys.
+ */
+
+void bench_lookup(int n) {
+    char ** keys = malloc(n * sizeof(char *));
+    rb_tree * tree = rbtree_init_pooled();
+
+    for (int i = 0; i < n; i++) {
+        char buffer[17];
+        snprintf(buffer, sizeof(buffer), "%08x%08x", (unsigned)i * 2654435761u, (unsigned)i);
+        keys[i] = strdup(buffer);
+        rbtree_insert(tree, keys[i], keys[i]);
+    }
+
+    for (int i = n - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        char * t = keys[i];
+        keys[i] = keys[j];
+        keys[j] = t;
+    }
+
+    int fd = cache_misses_open();
+    long long misses = 0;
+    struct timespec ts_start, ts_end;
+
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    for (int i = 0; i < n; i++) {
+        if (rbtree_get(tree, keys[i]) != keys[i]) {
+            fprintf(stderr, "ERROR: rbtree_get()\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+
+        close(fd);
+    }
+
+    printf("Lookup (%d keys): %.1f ns/op", n, time_diff(&ts_start, &ts_end) * 1e9 / n);
+
+    if (fd != -1 && misses != -1) {
+        printf(", %.2f cache misses/op\n", (double)misses / n);
+    } else {
+        printf(", cache misses not available\n");
+    }
+
+    rbtree_destroy(tree);
+
+    for (int i = 0; i < n; i++) {
+        free(keys[i]);
+    }
+
+    free(keys);
+}
+
+/// Arguments of a reader thread
+typedef struct reader_args {
+    rb_tree * tree;             ///< Shared tree
+    char ** keys;               ///< Keys to look up
+    int n;                      ///< Number of keys
+    int offset;                 ///< First key to look up
+} reader_args;
+
+void * reader_run(void * arg) {
+    reader_args * args = arg;
+
+    for (int i = 0; i < args->n; i++) {
+        if (rbtree_get(args->tree, args->keys[(args->offset + i) % args->n]) == NULL) {
+            fprintf(stderr, "ERROR: rbtree_get()\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return NULL;
+}
+
+/// Arguments of a joiner thread
+typedef struct joiner_args {
+    rb_tree * left;             ///< Tree to join into
+    rb_tree * right;            ///< Tree to join, overlapping left
+    int rounds;                 ///< Number of attempts
+} joiner_args;
+
+void * joiner_run(void * arg) {
+    joiner_args * args = arg;
+
+    for (int i = 0; i < args->rounds; i++) {
+        if (rbtree_join(args->left, args->right) != -1) {
+            fprintf(stderr, "ERROR: rbtree_join()\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return NULL;
+}
+
+/// Arguments of a writer thread that changes a tree while it is copied
+typedef struct writer_args {
+    rb_tree * tree;             ///< Shared tree, with keys "i000000" onwards set to 1
+    int k;                      ///< Number of initial keys
+    int max;                    ///< Maximum number of operations
+    int count;                  ///< Number of operations done
+    int stop;                   ///< Set to stop writing
+} writer_args;
+
+/**
+ * @brief Get the operation number i of a writer thread
+ *
+ * Every fourth operation inserts a new key, the one after it deletes the
+ * next initial key, and the rest update a live initial key. Values hold the
+ * operation number plus one, so that they are unique per key.
+ *
+ * @param i Operation number, from 1.
+ * @param k Number of initial keys.
+ * @param[out] key Key, as "i" or "n" followed by its index.
+ * @return New value of the key, or 0 if it is deleted.
+ */
+
+uintptr_t writer_op(int i, int k, char key[16]) {
+    int deleted = i / 4;
+
+    switch (i % 4) {
+    case 0:
+        snprintf(key, 16, "n%06d", deleted);
+        return i + 1;
+    case 3:
+        snprintf(key, 16, "i%06d", deleted);
+        return 0;
+    default:
+        snprintf(key, 16, "i%06d", deleted + (i * 7919) % (k - deleted));
+        return i + 1;
+    }
+}
+
+void * writer_run(void * arg) {
+    writer_args * args = arg;
+
+    for (int i = 1; i <= args->max && !__atomic_load_n(&args->stop, __ATOMIC_RELAXED); i++) {
+        char key[16];
+        uintptr_t value = writer_op(i, args->k, key);
+
+        if (value != 0) {
+            rbtree_upsert(args->tree, key, (void *)value);
+        } else {
+            rbtree_delete(args->tree, key);
+        }
+
+        __atomic_store_n(&args->count, i, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Check that a snapshot taken during writes is point-in-time
+ *
+ * Each key goes through a sequence of states, each one held between two
+ * operations. The state found in the snapshot bounds the number of
+ * operations that the snapshot saw, and all the keys must agree.
+ *
+ * @param n Number of initial keys.
+ */
+
+void check_snapshot_writes(int n) {
+    int k = n > 16 ? n : 16;
+    writer_args args = { rbtree_init(), k, 4 * k - 4, 0, 0 };
+    int nkeys = k + k;
+    uintptr_t * state = malloc(nkeys * sizeof(uintptr_t));
+    uintptr_t * seen = malloc(nkeys * sizeof(uintptr_t));
+    int * since = calloc(nkeys, sizeof(int));
+    char * resolved = calloc(nkeys, 1);
+    unsigned present = 0;
+    char key[16];
+
+    rbtree_set_concurrent(args.tree);
+
+    for (int j = 0; j < k; j++) {
+        snprintf(key, sizeof(key), "i%06d", j);
+        rbtree_insert(args.tree, key, (void *)1);
+    }
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, writer_run, &args);
+    rb_tree * snapshot = rbtree_snapshot(args.tree, NULL);
+    __atomic_store_n(&args.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(writer, NULL);
+
+    for (int x = 0; x < nkeys; x++) {
+        snprintf(key, sizeof(key), x < k ? "i%06d" : "n%06d", x < k ? x : x - k);
+        seen[x] = (uintptr_t)rbtree_get(snapshot, key);
+        state[x] = x < k;
+        present += seen[x] != 0;
+    }
+
+    // The snapshot saw the first p operations, with lo <= p < hi
+    int lo = 0;
+    int hi = args.count + 1;
+
+    for (int i = 1; i <= args.count; i++) {
+        uintptr_t value = writer_op(i, k, key);
+        int x = (key[0] == 'i' ? 0 : k) + atoi(key + 1);
+
+        if (!resolved[x] && seen[x] == state[x]) {
+            lo = since[x] > lo ? since[x] : lo;
+            hi = i < hi ? i : hi;
+            resolved[x] = 1;
+        }
+
+        since[x] = i;
+        state[x] = value;
+    }
+
+    for (int x = 0; x < nkeys; x++) {
+        if (!resolved[x]) {
+            assert(seen[x] == state[x]);
+            lo = since[x] > lo ? since[x] : lo;
+        }
+    }
+
+    assert(lo < hi);
+    assert(rbtree_size(snapshot) == present);
+
+    rbtree_destroy(snapshot);
+    rbtree_destroy(args.tree);
+    free(state);
+    free(seen);
+    free(since);
+    free(resolved);
+}
+
+/**
+ * @brief Measure read throughput on a concurrent tree
+ *
+ * Every thread looks up all the keys once, starting at a different offset.
+ * The number of threads doubles up to the number of online processors.
+ *
+ * @param n Number of keys.
+ */
+
+void bench_concurrent(int n) {
+    char ** keys = malloc(n * sizeof(char *));
+    rb_tree * tree = rbtree_init_pooled();
+    rbtree_set_concurrent(tree);
+
+    for (int i = 0; i < n; i++) {
+        char buffer[17];
+        snprintf(buffer, sizeof(buffer), "%08x%08x", (unsigned)i * 2654435761u, (unsigned)i);
+        keys[i] = strdup(buffer);
+        rbtree_insert(tree, keys[i], keys[i]);
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (long nthreads = 1; nthreads <= cores; nthreads *= 2) {
+        pthread_t * threads = malloc(nthreads * sizeof(pthread_t));
+        reader_args * args = malloc(nthreads * sizeof(reader_args));
+        struct timespec ts_start, ts_end;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+        for (long i = 0; i < nthreads; i++) {
+            args[i] = (reader_args){ tree, keys, n, (int)(i * (n / nthreads)) };
+            pthread_create(threads + i, NULL, reader_run, args + i);
+        }
+
+        for (long i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        printf("Concurrent lookup (%d keys, %ld threads): %.2f Mops/s\n", n, nthreads, n * nthreads / time_diff(&ts_start, &ts_end) / 1e6);
+
+        free(threads);
+        free(args);
+    }
+
+    for (long nthreads = 1; nthreads <= cores; nthreads *= 2) {
+        struct timespec ts_start, ts_end;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        rbtree_foreach_parallel(tree, scan_visit, NULL, nthreads);
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        printf("Parallel scan (%d keys, %ld threads): %.2f Mkeys/s\n", n, nthreads, n / time_diff(&ts_start, &ts_end) / 1e6);
+    }
+
+    rbtree_destroy(tree);
+
+    for (int i = 0; i < n; i++) {
+        free(keys[i]);
+    }
+
+    free(keys);
+}
+
 int main(int argc, char ** argv) {
     // Arguments
 
     if (argc < 2) {
-        fprintf(stderr, "Syntax: %s <N>\n", argv[0]);
+        fprintf(stderr, "Syntax: %s <N> | bench\n", argv[0]);
         return EXIT_FAILURE;
     }
 
+    if (strcmp(argv[1], "bench") == 0) {
+        bench_lookup(1000000);
+        bench_lookup(10000000);
+        bench_concurrent(1000000);
+        return EXIT_SUCCESS;
+    }
+
     // Initialize random generator
 
     char state[256];
@@ -53,6 +489,7 @@ int main(int argc, char ** argv) {
     rb_tree * tree = rbtree_init();
     assert(rbtree_empty(tree));
     rbtree_set_dispose(tree, free);
+    rbtree_set_concurrent(tree);
 
     int n = atoi(argv[1]);
     char ** keys = calloc(n, sizeof(char *));
@@ -87,27 +524,123 @@ int main(int argc, char ** argv) {
     int black_depth = rbtree_black_depth(tree);
     assert(black_depth != -1);
     printf("Black depth: %d\n", black_depth);
+
+    rb_stats stats = rbtree_stats(tree);
+    assert(stats.size == (unsigned)n);
+    assert(stats.black_depth == black_depth);
+
+#ifdef RBTREE_STATS
+    printf("Average depth: %.2f, %.2f comparisons/insert, %.2f rotations/insert\n", stats.average_depth, (double)stats.comparisons / n, (double)stats.rotations / n);
+    assert(stats.allocations == (unsigned)n);
+    assert(stats.path_length == rbtree_path_length(tree));
+#endif
+
     printf("Minimum: %s\n", rbtree_minimum(tree));
     printf("Maximum: %s\n", rbtree_maximum(tree));
 
     // Search ------------------------------------------------------------------
 
-    double lapse = 0;
+    int * lookups = malloc(n * sizeof(int));
 
     for (int i = 0; i < n; i++) {
         int32_t r;
         random_r(&data, &r);
-        r %= n;
+        lookups[i] = r % n;
+    }
 
-        clock_gettime(CLOCK_MONOTONIC, &ts_start);
-        rbtree_get(tree, keys[r]);
-        clock_gettime(CLOCK_MONOTONIC, &ts_end);
-        lapse += time_diff(&ts_start, &ts_end);
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    for (int i = 0; i < n; i++) {
+        rbtree_get(tree, keys[lookups[i]]);
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    double lapse = time_diff(&ts_start, &ts_end);
+    free(lookups);
+
     printf("Search: %.3f ms\n", lapse * 1e3);
     // printf("%.3f", lapse * 1e3);
 
+    // Key types -------------------------------------------------------------
+
+    {
+        rb_tree * numeric = rbtree_init_with_compare(numeric_compare);
+        rb_tree * u64 = rbtree_init_pooled();
+        rb_tree * binary = rbtree_init_pooled();
+        long long min = atoll(keys[0]);
+
+        rb_tree * custom = rbtree_init_with_compare(NULL);
+        assert(custom == NULL);
+        custom = rbtree_init_pooled();
+        int set = rbtree_set_compare(custom, NULL);
+        assert(set == -1);
+        set = rbtree_set_compare(custom, numeric_compare);
+        assert(set == 0);
+        rbtree_destroy(custom);
+
+        set = rbtree_set_key_type(u64, RB_KEY_U64, 0);
+        assert(set == 0);
+        set = rbtree_set_key_type(binary, RB_KEY_BINARY, 0);
+        assert(set == -1);
+        set = rbtree_set_key_type(binary, RB_KEY_CUSTOM, 0);
+        assert(set == -1);
+        set = rbtree_set_key_type(binary, RB_KEY_BINARY, 8);
+        assert(set == 0);
+
+        for (int i = 0; i < n; i++) {
+            long long k = atoll(keys[i]);
+            min = k < min ? k : min;
+
+            void * inserted = rbtree_insert(numeric, keys[i], keys[i]);
+            assert(inserted == keys[i]);
+            inserted = rbtree_insert(u64, RB_U64(k), keys[i]);
+            assert(inserted == keys[i]);
+            char be[8];
+
+            for (int j = 0; j < 8; j++) {
+                be[j] = (char)((uint64_t)k >> (56 - 8 * j));
+            }
+
+            inserted = rbtree_insert(binary, be, keys[i]);
+            assert(inserted == keys[i]);
+        }
+
+        // The key type of a non-empty tree cannot change
+        set = rbtree_set_key_type(binary, RB_KEY_U64, 0);
+        assert(set == -1);
+        set = rbtree_set_compare(u64, numeric_compare);
+        assert(set == -1);
+
+        uint64_t u64_min;
+        memcpy(&u64_min, rbtree_minimum(u64), sizeof(u64_min));
+        assert(atoll(rbtree_minimum(numeric)) == min);
+        assert(u64_min == (uint64_t)min);
+        assert(rbtree_get(binary, rbtree_minimum(binary)) == rbtree_get(u64, rbtree_minimum(u64)));
+        assert(rbtree_black_depth(u64) != -1);
+        assert(rbtree_black_depth(binary) != -1);
+
+        rb_tree * copy = rbtree_snapshot(u64, NULL);
+
+        for (int i = 0; i < n; i++) {
+            assert(rbtree_get(copy, RB_U64(atoll(keys[i]))) == keys[i]);
+            int deleted = rbtree_delete(u64, RB_U64(atoll(keys[i])));
+            assert(deleted == 1);
+        }
+
+        assert(rbtree_empty(u64));
+        rbtree_destroy(copy);
+        rbtree_destroy(numeric);
+        rbtree_destroy(u64);
+        rbtree_destroy(binary);
+    }
+
+    // Snapshot --------------------------------------------------------------
+
+    rb_tree * snapshot = rbtree_snapshot(tree, string_copy);
+    assert(rbtree_size(snapshot) == (unsigned)n);
+    assert(rbtree_black_depth(snapshot) != -1);
+    check_snapshot_writes(n);
+
     // Replace all values ------------------------------------------------------
 
     char ** reverse = calloc(n, sizeof(char *));
@@ -134,6 +667,80 @@ int main(int argc, char ** argv) {
         };
 
         assert(i == n);
+
+        for (i = 0; i < n; i++) {
+            assert(strcmp(rbtree_select(tree, i), k2[i]) == 0);
+            assert(rbtree_rank(tree, k2[i]) == (unsigned)i);
+        }
+
+        assert(rbtree_select(tree, n) == NULL);
+
+        rb_iter it;
+        const char * key;
+        rbtree_rdlock(tree);
+
+        for (i = 0, key = rbtree_iter_first(tree, &it); key != NULL; key = rbtree_iter_next(&it), i++) {
+            assert(strcmp(key, k2[i]) == 0);
+            assert(rbtree_iter_value(&it) == rbtree_get(tree, key));
+        }
+
+        for (key = rbtree_iter_last(tree, &it); key != NULL; key = rbtree_iter_prev(&it)) {
+            i--;
+            assert(strcmp(key, k2[i]) == 0);
+        }
+
+        rbtree_unlock(tree);
+        assert(i == 0);
+
+        for (i = 0; i < n && i < 256; i++) {
+            rb_tree * built = rbtree_build_sorted(k2, NULL, i);
+            assert(rbtree_size(built) == (unsigned)i);
+            assert(rbtree_black_depth(built) != -1);
+            rbtree_destroy(built);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        rb_tree * built = rbtree_build_sorted(k2, NULL, n);
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        printf("Sorted build: %.3f ms\n", time_diff(&ts_start, &ts_end) * 1e3);
+
+        assert(rbtree_size(built) == (unsigned)n);
+        assert(rbtree_black_depth(built) != -1);
+
+        for (i = 0; i < n; i++) {
+            assert(strcmp(rbtree_select(built, i), k2[i]) == 0);
+        }
+
+        for (i = 0; i < n; i += 2) {
+            int deleted = rbtree_delete(built, k2[i]);
+            assert(deleted == 1);
+            void * inserted = rbtree_insert(built, k2[i], k2[i]);
+            assert(inserted == k2[i]);
+        }
+
+        assert(rbtree_black_depth(built) != -1);
+        rbtree_relayout(built);
+        assert(rbtree_size(built) == (unsigned)n);
+        assert(rbtree_black_depth(built) != -1);
+
+        for (i = 0; i < n; i++) {
+            assert(rbtree_rank(built, k2[i]) == (unsigned)i);
+        }
+
+        rbtree_destroy(built);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        rbtree_relayout(tree);
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        printf("Relayout: %.3f ms\n", time_diff(&ts_start, &ts_end) * 1e3);
+
+        assert(rbtree_size(tree) == (unsigned)n);
+        assert(rbtree_black_depth(tree) == black_depth);
+
+        for (i = 0; i < n; i++) {
+            assert(strcmp(rbtree_select(tree, i), k2[i]) == 0);
+        }
+
         matrix_free(k2, n);
     }
 
@@ -147,9 +754,594 @@ int main(int argc, char ** argv) {
             printf("[%d] = %s\n", i, k2[i]);
         };
 
+        assert(rbtree_count_range(tree, "1", "2") == (unsigned)i);
+
+        rb_iter it;
+        const char * key = rbtree_iter_seek(tree, &it, "1");
+
+        for (int j = 0; j < i; j++, key = rbtree_iter_next(&it)) {
+            assert(strcmp(key, k2[j]) == 0);
+        }
+
+        assert(key == NULL || strcmp(key, "2") > 0);
+
+        int remaining = i + 1;
+        int stopped = rbtree_foreach_range(tree, "1", "2", count_visit, &remaining);
+        assert(stopped == 0);
+        assert(remaining == 1);
+
+        if (i > 1) {
+            remaining = 1;
+            stopped = rbtree_foreach_range(tree, "1", "2", count_visit, &remaining);
+            assert(stopped == 1);
+        }
         matrix_free(k2, i);
     }
 
+    // Parallel scan -----------------------------------------------------------
+
+    {
+        int visited = 0;
+        int stopped = rbtree_foreach_parallel(tree, count_parallel, &visited, 4);
+        assert(stopped == 0);
+        assert(visited == n);
+
+        key_span * span = rbtree_map_reduce(tree, span_map, span_reduce, NULL, 4);
+        assert(span->count == n);
+        assert(strcmp(span->first, rbtree_minimum(tree)) == 0);
+        assert(strcmp(span->last, rbtree_maximum(tree)) == 0);
+        free(span);
+
+        // Keys are digits, so "~" sorts last
+        rbtree_insert(tree, "~", NULL);
+        stopped = rbtree_foreach_parallel(tree, count_parallel, &visited, 0);
+        assert(stopped == 7);
+        rbtree_delete(tree, "~");
+    }
+
+    // Set operations ---------------------------------------------------------
+
+    {
+        rb_tree * even = rbtree_init();
+
+        for (int i = 0; i < n; i += 2) {
+            rbtree_insert(even, rbtree_select(tree, i), NULL);
+        }
+
+        rbtree_insert(even, "~", NULL);
+
+        rb_tree * both = rbtree_intersection(tree, even, 4);
+        rb_tree * odd = rbtree_difference(tree, even, 2);
+        rb_tree * all = rbtree_union(tree, even);
+
+        assert(rbtree_size(both) == (unsigned)(n + 1) / 2);
+        assert(rbtree_size(odd) == (unsigned)n / 2);
+        assert(rbtree_size(all) == (unsigned)n + 1);
+        assert(rbtree_black_depth(both) != -1 && rbtree_black_depth(odd) != -1);
+
+        for (int i = 0; i < n; i++) {
+            const char * key = rbtree_select(tree, i);
+            assert(rbtree_get(i % 2 ? odd : both, key) == rbtree_get(tree, key));
+            assert(rbtree_get(all, key) == rbtree_get(tree, key));
+        }
+
+        // The smaller tree is walked, but values still come from the first one
+        rbtree_destroy(both);
+        both = rbtree_intersection(even, tree, 0);
+        assert(rbtree_size(both) == (unsigned)(n + 1) / 2);
+        assert(rbtree_get(both, rbtree_minimum(tree)) == NULL);
+
+        int changes[3] = { 0 };
+        int stopped = rbtree_diff(tree, even, NULL, count_diff, changes);
+        assert(stopped == 0);
+        assert(changes[RB_DIFF_ADDED] == 1);
+        assert(changes[RB_DIFF_REMOVED] == n / 2);
+        assert(changes[RB_DIFF_CHANGED] == (n + 1) / 2);
+
+        rbtree_destroy(both);
+        rbtree_destroy(odd);
+        rbtree_destroy(all);
+        rbtree_destroy(even);
+    }
+
+    // The snapshot keeps copies of the old values, that were disposed by rbtree_replace
+
+    for (int i = 0; i < n; i++) {
+        assert(strcmp(rbtree_get(snapshot, reverse[i]), reverse[i]) == 0);
+        assert(rbtree_get(snapshot, reverse[i]) != rbtree_get(tree, reverse[i]));
+    }
+
+    rbtree_destroy(snapshot);
+
+    // Memory-mapped image ----------------------------------------------------
+
+    {
+        char path[] = "/tmp/rbtree-XXXXXX";
+        close(mkstemp(path));
+        int saved = rbtree_save(tree, path, string_size);
+        assert(saved == 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        rb_tree * mapped = rbtree_open_mmap(path);
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        printf("Open image: %.3f ms\n", time_diff(&ts_start, &ts_end) * 1e3);
+
+        assert(mapped != NULL);
+        assert(rbtree_size(mapped) == (unsigned)n);
+        int set = rbtree_set_compare(mapped, numeric_compare);
+        assert(set == -1);
+        assert(rbtree_black_depth(mapped) > 0);
+        assert(strcmp(rbtree_minimum(mapped), rbtree_minimum(tree)) == 0);
+        assert(strcmp(rbtree_maximum(mapped), rbtree_maximum(tree)) == 0);
+        assert(rbtree_count_range(mapped, "1", "2") == rbtree_count_range(tree, "1", "2"));
+        assert(rbtree_get(mapped, "-") == NULL);
+
+        // The path length of an image matches the tree that it is built into
+        rb_tree * promoted = rbtree_open_mmap(path);
+        uint64_t image_length = rbtree_path_length(promoted);
+#ifdef RBTREE_STATS
+        assert(rbtree_stats(promoted).path_length == image_length);
+#endif
+        rbtree_relayout(promoted);
+        assert(rbtree_path_length(promoted) == image_length);
+        rbtree_destroy(promoted);
+
+        rb_iter it;
+        int i;
+
+        for (i = 0; i < n; i++) {
+            assert(strcmp(rbtree_get(mapped, reverse[i]), reverse[i]) == 0);
+            assert(rbtree_rank(mapped, reverse[i]) == rbtree_rank(tree, reverse[i]));
+            assert(strcmp(rbtree_select(mapped, i), rbtree_select(tree, i)) == 0);
+        }
+
+        i = 0;
+
+        for (const char * key = rbtree_iter_first(mapped, &it); key != NULL; key = rbtree_iter_next(&it), i++) {
+            assert(strcmp(key, rbtree_iter_value(&it)) == 0);
+        }
+
+        assert(i == n);
+
+        for (const char * key = rbtree_iter_last(mapped, &it); key != NULL; key = rbtree_iter_prev(&it)) {
+            i--;
+        }
+
+        assert(i == 0);
+
+        key_span * span = rbtree_map_reduce(mapped, span_map, span_reduce, NULL, 3);
+        assert(span->count == n);
+        free(span);
+
+        rb_tree * none = rbtree_difference(mapped, tree, 2);
+        assert(rbtree_size(none) == 0);
+        rbtree_destroy(none);
+
+        int changes[3] = { 0 };
+        int stopped = rbtree_diff(mapped, tree, string_equal, count_diff, changes);
+        assert(stopped == 0);
+        assert(changes[0] + changes[1] + changes[2] == 0);
+
+        // Writes build the nodes
+        rbtree_insert(mapped, "-", NULL);
+        assert(rbtree_size(mapped) == (unsigned)n + 1);
+        assert(rbtree_black_depth(mapped) != -1);
+
+        for (i = 0; i < n; i++) {
+            assert(strcmp(rbtree_get(mapped, reverse[i]), reverse[i]) == 0);
+        }
+
+        rbtree_destroy(mapped);
+
+        // Corrupted images are rejected when opened
+        uint32_t key_type = 9;
+        FILE * file = fopen(path, "r+b");
+        fseek(file, 8, SEEK_SET);
+        fwrite(&key_type, sizeof(key_type), 1, file);
+        fclose(file);
+        mapped = rbtree_open_mmap(path);
+        assert(mapped == NULL);
+
+        key_type = RB_KEY_STRING;
+        file = fopen(path, "r+b");
+        fseek(file, 8, SEEK_SET);
+        fwrite(&key_type, sizeof(key_type), 1, file);
+        fclose(file);
+        mapped = rbtree_open_mmap(path);
+        assert(mapped != NULL);
+        rbtree_destroy(mapped);
+
+        // The first entry follows the 32-byte header: key offset, value offset and value size
+        struct stat st;
+        stat(path, &st);
+        uint64_t entry[3];
+        uint64_t bad[3];
+        file = fopen(path, "r+b");
+        fseek(file, 32, SEEK_SET);
+        size_t got = fread(entry, sizeof(entry), 1, file);
+        assert(got == 1);
+
+        for (int j = 0; j < 3; j++) {
+            memcpy(bad, entry, sizeof(bad));
+            bad[j] = (uint64_t)st.st_size + 1;
+            fseek(file, 32, SEEK_SET);
+            fwrite(bad, sizeof(bad), 1, file);
+            fflush(file);
+            mapped = rbtree_open_mmap(path);
+            assert(mapped == NULL);
+        }
+
+        fseek(file, 32, SEEK_SET);
+        fwrite(entry, sizeof(entry), 1, file);
+        fclose(file);
+        mapped = rbtree_open_mmap(path);
+        assert(mapped != NULL);
+        rbtree_destroy(mapped);
+
+        int truncated = truncate(path, st.st_size - 1);
+        assert(truncated == 0);
+        mapped = rbtree_open_mmap(path);
+        assert(mapped == NULL);
+
+        unlink(path);
+    }
+
+    // Split and join ---------------------------------------------------------
+
+    {
+        rb_tree * whole = rbtree_init();
+
+        for (int i = 0; i < n; i++) {
+            rbtree_insert(whole, reverse[i], NULL);
+        }
+
+        int cuts[] = { 0, 1, n / 3, n - 1, n };
+
+        for (unsigned c = 0; c < sizeof(cuts) / sizeof(cuts[0]); c++) {
+            const char * key = cuts[c] < n ? rbtree_select(tree, cuts[c]) : "~";
+            rb_tree * left;
+            rb_tree * right;
+
+            clock_gettime(CLOCK_MONOTONIC, &ts_start);
+            rbtree_split(whole, key, &left, &right);
+            clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+            if (cuts[c] == n / 3) {
+                printf("Split: %.3f us\n", time_diff(&ts_start, &ts_end) * 1e6);
+            }
+
+            assert(left == whole);
+            assert(rbtree_size(left) == (unsigned)cuts[c]);
+            assert(rbtree_size(right) == (unsigned)(n - cuts[c]));
+            assert(rbtree_black_depth(left) != -1 && rbtree_black_depth(right) != -1);
+            assert(rbtree_empty(left) || strcmp(rbtree_maximum(left), key) < 0);
+            assert(rbtree_empty(right) || strcmp(rbtree_minimum(right), key) == 0);
+#ifdef RBTREE_STATS
+            assert(rbtree_stats(right).path_length == rbtree_path_length(right));
+#endif
+
+            // Overlapping keys are rejected
+            if (!rbtree_empty(left) && !rbtree_empty(right)) {
+                int joined = rbtree_join(right, left);
+                assert(joined == -1);
+            }
+
+            int joined = rbtree_join(left, right);
+            assert(joined == 0);
+            assert(rbtree_size(whole) == (unsigned)n);
+            assert(rbtree_black_depth(whole) != -1);
+            check_order(whole);
+#ifdef RBTREE_STATS
+            assert(rbtree_stats(whole).path_length == rbtree_path_length(whole));
+#endif
+        }
+
+        for (int i = 0; i < n; i++) {
+            assert(strcmp(rbtree_select(whole, i), rbtree_select(tree, i)) == 0);
+        }
+
+        // Range deletion
+        unsigned band = rbtree_count_range(whole, "1", "2");
+        unsigned removed = rbtree_delete_range(whole, "1", "2");
+        assert(removed == band);
+        assert(rbtree_size(whole) == n - band);
+        assert(rbtree_count_range(whole, "1", "2") == 0);
+        assert(rbtree_black_depth(whole) != -1);
+        removed = rbtree_delete_range(whole, "1", "2");
+        assert(removed == 0);
+        check_order(whole);
+#ifdef RBTREE_STATS
+        assert(rbtree_stats(whole).path_length == rbtree_path_length(whole));
+#endif
+
+        for (int i = 0; i < n; i++) {
+            const char * key = rbtree_select(tree, i);
+
+            if (strcmp(key, "1") < 0) {
+                assert(rbtree_rank(whole, key) == (unsigned)i);
+            } else if (strcmp(key, "2") > 0) {
+                assert(rbtree_rank(whole, key) == i - band);
+            }
+        }
+
+        removed = rbtree_delete_range(whole, "", "~");
+        assert(removed == n - band);
+        assert(rbtree_empty(whole));
+        rbtree_destroy(whole);
+
+        // Pooled halves share their pool, and joins across allocators
+        char ** sorted = malloc(sizeof(char *) * n);
+
+        for (int i = 0; i < n; i++) {
+            sorted[i] = (char *)rbtree_select(tree, i);
+        }
+
+        rb_tree * pooled = rbtree_build_sorted(sorted, NULL, n);
+        rb_tree * left;
+        rb_tree * right;
+        const char * key = rbtree_select(tree, n / 2);
+
+        rbtree_split(pooled, key, &left, &right);
+        assert(rbtree_size(left) == (unsigned)(n / 2));
+        assert(rbtree_size(right) == (unsigned)(n - n / 2));
+
+        for (int i = 0; i < n / 2; i++) {
+            rbtree_delete(left, sorted[i]);
+            void * inserted = rbtree_insert(left, sorted[i], sorted[i]);
+            assert(inserted == sorted[i]);
+        }
+
+        rb_tree * other = rbtree_init_pooled();
+        rb_tree * plain = rbtree_init();
+        rb_tree * tail;
+
+        // Right keeps the shared pool alive after left is gone
+        rbtree_split(right, n / 4 > 0 ? rbtree_select(tree, n - n / 4) : "~", &right, &tail);
+        int joined = rbtree_join(other, right);
+        assert(joined == 0);
+        rbtree_destroy(left);
+        joined = rbtree_join(plain, other);
+        assert(joined == 0);
+        joined = rbtree_join(plain, tail);
+        assert(joined == 0);
+        assert(rbtree_size(plain) == (unsigned)(n - n / 2));
+        assert(rbtree_black_depth(plain) != -1);
+        check_order(plain);
+
+        for (int i = n / 2; i < n; i++) {
+            rbtree_delete(plain, sorted[i]);
+        }
+
+        assert(rbtree_empty(plain));
+        rbtree_destroy(plain);
+        free(sorted);
+
+        // Self joins and opposite joins of concurrent trees fail without deadlocking
+        rb_tree * odd = rbtree_init();
+        rb_tree * even = rbtree_init();
+        rbtree_set_concurrent(odd);
+        rbtree_set_concurrent(even);
+        rbtree_insert(odd, "1", NULL);
+        rbtree_insert(odd, "3", NULL);
+        rbtree_insert(even, "2", NULL);
+
+        joined = rbtree_join(odd, odd);
+        assert(joined == -1);
+
+        pthread_t joiner;
+        joiner_args forward = { odd, even, 10000 };
+        joiner_args backward = { even, odd, 10000 };
+        pthread_create(&joiner, NULL, joiner_run, &backward);
+        joiner_run(&forward);
+        pthread_join(joiner, NULL);
+
+        assert(rbtree_size(odd) == 2 && rbtree_size(even) == 1);
+        rbtree_destroy(odd);
+        rbtree_destroy(even);
+    }
+
+    // Hinted access ----------------------------------------------------------
+
+    {
+        rb_tree * near = rbtree_init();
+        rb_hint hint = { 0 };
+        rbtree_set_finger(near);
+
+        for (int i = 0; i < n; i++) {
+            const char * key = rbtree_select(tree, i);
+
+            void * inserted = i % 2 ? rbtree_insert_hint(near, key, (void *)key, &hint) : rbtree_insert(near, key, (void *)key);
+            assert(inserted == key);
+        }
+
+        assert(rbtree_size(near) == (unsigned)n);
+        assert(rbtree_black_depth(near) != -1);
+        void * found = rbtree_get_hint(near, "-", &hint);
+        assert(found == NULL);
+
+#ifdef RBTREE_STATS
+        uint64_t comparisons = rbtree_stats(near).comparisons;
+#endif
+
+        for (int i = n - 1; i >= 0; i--) {
+            const char * key = rbtree_select(tree, i);
+            found = rbtree_get_hint(near, key, &hint);
+            assert(found == key);
+            found = rbtree_get(near, key);
+            assert(found == key);
+        }
+
+#ifdef RBTREE_STATS
+        // Both lookups of every key find it next to the previous one
+        assert(rbtree_stats(near).comparisons - comparisons < (uint64_t)n * 2 * 8);
+#endif
+
+        // Deleting the hinted node makes the hint stale
+        const char * key = rbtree_select(tree, n / 2);
+        found = rbtree_get_hint(near, key, &hint);
+        assert(found == key);
+        int deleted = rbtree_delete(near, key);
+        assert(deleted == 1);
+        found = rbtree_get_hint(near, key, &hint);
+        assert(found == NULL);
+
+#ifdef RBTREE_STATS
+        comparisons = rbtree_stats(near).comparisons;
+#endif
+
+        // Deletions move the finger to the next key
+        for (int i = 0; i < n / 4; i++) {
+            deleted = rbtree_delete(near, rbtree_select(tree, i));
+            assert(deleted == 1);
+        }
+
+#ifdef RBTREE_STATS
+        assert(rbtree_stats(near).comparisons - comparisons < (uint64_t)n / 4 * 8 + 64);
+#endif
+
+        if (n > 1) {
+            found = rbtree_get_hint(near, rbtree_maximum(near), &hint);
+            assert(strcmp(found, rbtree_maximum(near)) == 0);
+            found = rbtree_get(near, rbtree_minimum(near));
+            assert(strcmp(found, rbtree_minimum(near)) == 0);
+        }
+
+        rbtree_destroy(near);
+    }
+
+    // Priority queue ---------------------------------------------------------
+
+    {
+        rb_tree * queue = rbtree_init();
+        int lo = 0;
+        int hi = n - 1;
+
+        for (int i = 0; i < n; i++) {
+            rbtree_insert(queue, reverse[i], reverse[i]);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+        while (lo <= hi) {
+            void * value;
+            char * key = (lo + hi) % 2 ? rbtree_pop_min(queue, &value) : rbtree_pop_max(queue, &value);
+            int index = (lo + hi) % 2 ? lo++ : hi--;
+
+            assert(strcmp(key, rbtree_select(tree, index)) == 0);
+            assert(strcmp(key, value) == 0);
+            assert(lo > hi || strcmp(rbtree_minimum(queue), rbtree_select(tree, lo)) == 0);
+            assert(lo > hi || strcmp(rbtree_maximum(queue), rbtree_select(tree, hi)) == 0);
+            free(key);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        printf("Pop: %.3f ms\n", time_diff(&ts_start, &ts_end) * 1e3);
+
+        char * popped = rbtree_pop_min(queue, NULL);
+        assert(popped == NULL);
+        assert(rbtree_minimum(queue) == NULL && rbtree_maximum(queue) == NULL);
+        rbtree_destroy(queue);
+    }
+
+    // Incremental destruction ------------------------------------------------
+
+    {
+        rb_tree * partial = rbtree_init();
+        int steps = 0;
+
+        for (int i = 0; i < n; i++) {
+            rbtree_insert(partial, reverse[i], NULL);
+        }
+
+        while (!rbtree_destroy_step(partial, 64)) {
+            steps++;
+        }
+
+        assert(steps == (n - 1) / 64);
+
+        // Pooled trees visit nodes only to dispose values
+        partial = rbtree_snapshot(tree, string_copy);
+
+        while (!rbtree_destroy_step(partial, 64)) {
+            continue;
+        }
+    }
+
+    // Pooled allocation ------------------------------------------------------
+
+    {
+        rb_tree * pooled = rbtree_init_pooled();
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+        for (int i = 0; i < n; i++) {
+            if (rbtree_insert(pooled, reverse[i], reverse[i]) == NULL) {
+                fprintf(stderr, "ERROR: rbtree_insert()\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        printf("Pooled insert: %.3f ms\n", time_diff(&ts_start, &ts_end) * 1e3);
+        assert(rbtree_size(pooled) == (unsigned)n);
+
+        for (int i = 0; i < n; i += 2) {
+            int deleted = rbtree_delete(pooled, reverse[i]);
+            assert(deleted == 1);
+        }
+
+        assert(rbtree_black_depth(pooled) != -1);
+
+        unsigned band = rbtree_count_range(pooled, "3", "5");
+        unsigned removed = rbtree_delete_range(pooled, "3", "5");
+        assert(removed == band);
+        assert(rbtree_size(pooled) == (unsigned)n / 2 - band);
+        assert(rbtree_black_depth(pooled) != -1);
+        check_order(pooled);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        rbtree_destroy(pooled);
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        printf("Pooled destroy: %.3f ms\n", time_diff(&ts_start, &ts_end) * 1e3);
+
+        pooled = rbtree_init_pooled();
+
+        for (int i = 0; i < n; i++) {
+            int inserted;
+            void ** slot = rbtree_insert_or_get(pooled, reverse[i], &inserted);
+            assert(inserted && *slot == NULL);
+            *slot = reverse[i];
+            void ** again = rbtree_insert_or_get(pooled, reverse[i], &inserted);
+            assert(again == slot && !inserted);
+            void * upserted = rbtree_upsert(pooled, reverse[i], reverse[n - i - 1]);
+            assert(upserted == reverse[n - i - 1]);
+        }
+
+        assert(rbtree_size(pooled) == (unsigned)n);
+        assert(rbtree_black_depth(pooled) != -1);
+
+        for (int i = 0; i < n; i++) {
+            assert(rbtree_get(pooled, reverse[i]) == reverse[n - i - 1]);
+        }
+
+        rbtree_destroy(pooled);
+        pooled = rbtree_init_pooled();
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        unsigned inserted = rbtree_insert_batch(pooled, reverse, (void * const *)reverse, n);
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+        printf("Batch insert: %.3f ms\n", time_diff(&ts_start, &ts_end) * 1e3);
+
+        assert(inserted == (unsigned)n);
+        inserted = rbtree_insert_batch(pooled, reverse, NULL, n);
+        assert(inserted == 0);
+        assert(rbtree_black_depth(pooled) != -1);
+
+        for (int i = 0; i < n; i++) {
+            assert(rbtree_get(pooled, reverse[i]) == reverse[i]);
+        }
+
+        rbtree_destroy(pooled);
+    }
+
     // Deletion ----------------------------------------------------------------
 
     for (int i = 0; i < n; i++) {
@@ -159,6 +1351,13 @@ int main(int argc, char ** argv) {
         }
 
         assert(rbtree_black_depth(tree) != -1);
+        assert(rbtree_size(tree) == (unsigned)(n - i - 1));
+
+#ifdef RBTREE_STATS
+        if (i == n / 2) {
+            assert(rbtree_stats(tree).path_length == rbtree_path_length(tree));
+        }
+#endif
     }
 
     free(keys);
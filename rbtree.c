@@ -15,621 +15,4044 @@
  * Foundation.
  */
 
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rbtree.h"
 
 /* Private functions **********************************************************/
 
-#define grandparent parent->parent
-
 /**
- * @brief Create and initialize a red-black tree node
+ * @brief Take the tree lock for reading, if the tree is concurrent
  *
- * @param key Data key. It will be duplicated.
- * @param value Data value.
- * @return Pointer to a newly created node.
+ * @param tree Pointer to a red-black tree.
  */
 
-static rb_node * rb_init(const char * key, void * value) {
-    rb_node * node = calloc(1, sizeof(rb_node));
-    node->key = strdup(key);
-    node->value = value;
-    node->color = RB_RED;
-    return node;
+static void rb_rdlock(const rb_tree * tree) {
+    if (tree->lock != NULL) {
+        pthread_rwlock_rdlock(tree->lock);
+    }
 }
 
 /**
- * @brief Free a red-black subtree
- * @param node Pointer to a red-black tree node.
- * @param dispose Pointer to function to dispose an element.
- * @post If dispose is not NULL, the value is freed.
+ * @brief Take the tree lock for writing, if the tree is concurrent
+ *
+ * @param tree Pointer to a red-black tree.
  */
 
-static void rb_destroy(rb_node * node, void (*dispose)(void *)) {
-    if (node->left != NULL) {
-        rb_destroy(node->left, dispose);
-    }
-
-    if (node->right != NULL) {
-        rb_destroy(node->right, dispose);
+static void rb_wrlock(const rb_tree * tree) {
+    if (tree->lock != NULL) {
+        pthread_rwlock_wrlock(tree->lock);
     }
+}
 
-    free(node->key);
+/**
+ * @brief Release the tree lock, if the tree is concurrent
+ *
+ * @param tree Pointer to a red-black tree.
+ */
 
-    if (node->value != NULL && dispose != NULL) {
-        dispose(node->value);
+static void rb_unlock(const rb_tree * tree) {
+    if (tree->lock != NULL) {
+        pthread_rwlock_unlock(tree->lock);
     }
-
-    free(node);
 }
 
+#ifdef RBTREE_STATS
+#define RB_STAT(tree, field, n) __atomic_add_fetch(&(tree)->stats->field, (uint64_t)(n), __ATOMIC_RELAXED)
+#else
+#define RB_STAT(tree, field, n) ((void)(tree))
+#endif
+
+#define RB_POOL_CHUNK   (1 << 20)   // Default chunk size
+#define RB_POOL_GRAIN   8           // Block size granularity
+#define RB_POOL_CLASSES 64          // Number of size classes (up to 512 bytes)
+
+#define rb_pool_round(size) (((size) + RB_POOL_GRAIN - 1) & ~(size_t)(RB_POOL_GRAIN - 1))
+
+/// Header of a pool chunk
+typedef struct rb_chunk {
+    struct rb_chunk * prev;     ///< Pointer to previous chunk
+    struct rb_chunk * next;     ///< Pointer to next chunk
+    size_t size;                ///< Chunk size, including this header
+    struct rb_pool * pool;      ///< Pool that owns the chunk
+} rb_chunk;
+
+/// Reference from a pool to another one that it keeps alive
+typedef struct rb_pool_ref {
+    struct rb_pool * pool;      ///< Pointer to the retained pool
+    struct rb_pool_ref * next;  ///< Pointer to next reference
+} rb_pool_ref;
+
+/// Memory pool: bump allocation over chunks plus per-class free lists
+typedef struct rb_pool {
+    rb_chunk * chunks;                  ///< List of chunks
+    char * cursor;                      ///< Next free byte in current chunk
+    char * end;                         ///< End of current chunk
+    void * free[RB_POOL_CLASSES];       ///< Free lists, one per size class
+    unsigned refs;                      ///< Number of trees and pools that hold the pool
+    pthread_mutex_t * lock;             ///< Pool lock, once it is shared
+    rb_pool_ref * retained;             ///< Pools whose blocks this pool may hold
+} rb_pool;
+
 /**
- * @brief Find a node from a subtree
+ * @brief Create an empty memory pool
  *
- * @param node Pointer to a red-black tree node.
- * @param key Data key (search criteria).
- * @return Pointer to the node storing the key, if found.
- * @retval NULL Key not found.
+ * @return Pointer to a pool held by one reference.
  */
 
-rb_node * rb_get(rb_node * node, const char * key) {
-    while (node != NULL) {
-        int cmp = strcmp(key, node->key);
+static rb_pool * rb_pool_create() {
+    rb_pool * pool = calloc(1, sizeof(rb_pool));
+    pool->refs = 1;
+    return pool;
+}
 
-        if (cmp == 0) {
-            break;
-        }
+/**
+ * @brief Take the pool lock, if the pool is shared
+ *
+ * @param pool Pointer to a memory pool.
+ */
 
-        node = cmp < 0 ? node->left : node->right;
+static void rb_pool_lock(rb_pool * pool) {
+    if (pool->lock != NULL) {
+        pthread_mutex_lock(pool->lock);
     }
-
-    return node;
 }
 
 /**
- * @brief Get the node with the minimum key from a subtree
- *
- * Return the leftmost node of the subtree.
+ * @brief Release the pool lock, if the pool is shared
  *
- * @param node Pointer to a red-black tree node.
- * @return Pointer to the node storing the minimum key.
+ * @param pool Pointer to a memory pool.
  */
 
-static rb_node * rb_min(rb_node * node) {
-    rb_node * t;
-    for (t = node; t->left != NULL; t = t->left);
-    return t;
+static void rb_pool_unlock(rb_pool * pool) {
+    if (pool->lock != NULL) {
+        pthread_mutex_unlock(pool->lock);
+    }
 }
 
 /**
- * @brief Get the node with the maximum key from a subtree
+ * @brief Add a reference to a pool
  *
- * Return the rightmost node of the subtree.
+ * The first time a pool gets a second holder, it gets a lock, since holders
+ * may be used from different threads. At that point, the only holder must be
+ * locked by the caller, so the pool is not in use.
  *
- * @param node Pointer to a red-black tree node.
- * @return Pointer to the node storing the maximum key.
+ * @param pool Pointer to a memory pool.
  */
 
-static rb_node * rb_max(rb_node * node) {
-    rb_node * t;
-    for (t = node; t->right != NULL; t = t->right);
-    return t;
+static void rb_pool_share(rb_pool * pool) {
+    if (pool->lock == NULL) {
+        pool->lock = malloc(sizeof(pthread_mutex_t));
+        pthread_mutex_init(pool->lock, NULL);
+    }
+
+    rb_pool_lock(pool);
+    pool->refs++;
+    rb_pool_unlock(pool);
 }
 
 /**
- * @brief Get the uncle of a node
+ * @brief Keep a pool alive for as long as another pool
  *
- * @param node Pointer to a red-black tree node.
- * @return Pointer to the sibling of node's parent.
+ * After this call, blocks of other can be freed into pool.
+ *
+ * @param pool Pointer to a memory pool.
+ * @param other Pointer to the pool to retain.
  */
 
-static rb_node * rb_uncle(rb_node * node) {
-    rb_node * gp;
-    return (node->parent && (gp = node->grandparent)) ? (node->parent == gp->left) ? gp->right : gp->left : NULL;
+static void rb_pool_retain(rb_pool * pool, rb_pool * other) {
+    if (pool == other) {
+        return;
+    }
+
+    rb_pool_ref * ref = malloc(sizeof(rb_pool_ref));
+    rb_pool_share(other);
+
+    rb_pool_lock(pool);
+    ref->pool = other;
+    ref->next = pool->retained;
+    pool->retained = ref;
+    rb_pool_unlock(pool);
 }
 
 /**
- * @brief Rotate a subtree to left
+ * @brief Allocate a chunk and link it into a pool
  *
- * @param tree Pointer to a red-black tree.
- * @param node Pointer to the pivot node.
+ * @param pool Pointer to a memory pool.
+ * @param size Usable size of the chunk.
+ * @return Pointer to the first usable byte.
  */
 
-static void rb_rotate_left(rb_tree * tree, rb_node * node) {
-    rb_node * t = node->right;
-
-    if (node->parent == NULL) {
-        tree->root = t;
-    } else {
-        if (node == node->parent->left) {
-            node->parent->left = t;
-        } else {
-            node->parent->right = t;
-        }
-    }
+static char * rb_pool_chunk(rb_pool * pool, size_t size) {
+    rb_chunk * chunk = malloc(sizeof(rb_chunk) + size);
+    chunk->prev = NULL;
+    chunk->next = pool->chunks;
+    chunk->size = sizeof(rb_chunk) + size;
+    chunk->pool = pool;
 
-    if (t->left != NULL) {
-        t->left->parent = node;
+    if (pool->chunks != NULL) {
+        pool->chunks->prev = chunk;
     }
 
-    node->right = t->left;
-    t->left = node;
-    t->parent = node->parent;
-    node->parent = t;
+    pool->chunks = chunk;
+    return (char *)(chunk + 1);
 }
 
 /**
- * @brief Rotate a subtree to right
+ * @brief Allocate a block from a pool
  *
- * @param tree Pointer to a red-black tree.
- * @param node Pointer to the pivot node.
+ * Blocks larger than the biggest size class get a chunk of their own.
+ *
+ * @param context Pointer to a memory pool.
+ * @param size Block size.
+ * @return Pointer to a block of at least size bytes.
  */
 
-static void rb_rotate_right(rb_tree * tree, rb_node * node) {
-    rb_node * t = node->left;
+static void * rb_pool_alloc(void * context, size_t size) {
+    rb_pool * pool = context;
+    size = rb_pool_round(size);
+    size_t class = size / RB_POOL_GRAIN - 1;
+    void * block;
 
-    if (node->parent == NULL) {
-        tree->root = t;
+    rb_pool_lock(pool);
+
+    if (class >= RB_POOL_CLASSES) {
+        block = rb_pool_chunk(pool, size);
+    } else if (pool->free[class] != NULL) {
+        block = pool->free[class];
+        pool->free[class] = *(void **)block;
     } else {
-        if (node == node->parent->left) {
-            node->parent->left = t;
-        } else {
-            node->parent->right = t;
+        if ((size_t)(pool->end - pool->cursor) < size) {
+            pool->cursor = rb_pool_chunk(pool, RB_POOL_CHUNK);
+            pool->end = pool->cursor + RB_POOL_CHUNK;
         }
-    }
 
-    if (t->right != NULL) {
-        t->right->parent = node;
+        block = pool->cursor;
+        pool->cursor += size;
     }
 
-    node->left = t->right;
-    t->right = node;
-    t->parent = node->parent;
-    node->parent = t;
+    rb_pool_unlock(pool);
+    return block;
 }
 
 /**
- * @brief Balance a tree after an insertion
+ * @brief Make room in a pool for a number of bytes in one chunk
  *
- * @param tree Pointer to a red-black tree.
- * @param node Pointer to the node that was inserted.
+ * The following allocations of up to size bytes in total are served from the
+ * same contiguous chunk, unless freed blocks are recycled.
+ *
+ * @param pool Pointer to a memory pool.
+ * @param size Number of bytes, rounded as rb_pool_alloc does.
  */
 
-static void rb_balance_insert(rb_tree * tree, rb_node * node) {
-    while (node->parent && node->parent->color == RB_RED) {
-        rb_node * uncle = rb_uncle(node);
+static void rb_pool_reserve(rb_pool * pool, size_t size) {
+    if ((size_t)(pool->end - pool->cursor) < size) {
+        pool->cursor = rb_pool_chunk(pool, size);
+        pool->end = pool->cursor + size;
+    }
+}
 
-        if (uncle != NULL && uncle->color == RB_RED) {
-            node->parent->color = RB_BLACK;
-            uncle->color = RB_BLACK;
-            node->grandparent->color = RB_RED;
+/**
+ * @brief Return a block to a pool
+ *
+ * The block may come from a retained pool. Large blocks are unlinked from the
+ * pool that owns their chunk.
+ *
+ * @param context Pointer to a memory pool.
+ * @param ptr Pointer to the block.
+ * @param size Size that the block was allocated with.
+ */
 
-            node = node->grandparent;
-        } else {
-            if (node->parent == node->grandparent->left) {
-                if (node == node->parent->right) {
-                    node = node->parent;
-                    rb_rotate_left(tree, node);
-                }
+static void rb_pool_free(void * context, void * ptr, size_t size) {
+    rb_pool * pool = context;
+    size = rb_pool_round(size);
+    size_t class = size / RB_POOL_GRAIN - 1;
 
-                node->parent->color = RB_BLACK;
-                node->grandparent->color = RB_RED;
+    if (class >= RB_POOL_CLASSES) {
+        rb_chunk * chunk = (rb_chunk *)ptr - 1;
+        rb_pool * owner = chunk->pool;
 
-                rb_rotate_right(tree, node->grandparent);
-            } else {
-                if (node == node->parent->left) {
-                    node = node->parent;
-                    rb_rotate_right(tree, node);
-                }
+        rb_pool_lock(owner);
 
-                node->parent->color = RB_BLACK;
-                node->grandparent->color = RB_RED;
+        if (chunk->prev != NULL) {
+            chunk->prev->next = chunk->next;
+        } else {
+            owner->chunks = chunk->next;
+        }
 
-                rb_rotate_left(tree, node->grandparent);
-            }
+        if (chunk->next != NULL) {
+            chunk->next->prev = chunk->prev;
         }
+
+        rb_pool_unlock(owner);
+        free(chunk);
+        return;
     }
 
-    tree->root->color = RB_BLACK;
+    rb_pool_lock(pool);
+    *(void **)ptr = pool->free[class];
+    pool->free[class] = ptr;
+    rb_pool_unlock(pool);
 }
 
 /**
- * @brief Balance a tree after a deletion
+ * @brief Drop a reference to a pool
  *
- * @param tree Pointer to the red-black tree.
- * @param node Pointer to the node that was deleted.
- * @param parent Pointer to the parent of node.
+ * When the last reference is dropped, the pool and all of its chunks are
+ * freed, and so are the references that it holds on retained pools.
+ *
+ * @param context Pointer to a memory pool.
  */
 
-static void rb_balance_delete(rb_tree * tree, rb_node * node, rb_node * parent) {
-    while (parent != NULL && (node == NULL || node->color == RB_BLACK)) {
-        if (node == parent->left) {
-            rb_node * sibling = parent->right;
+static void rb_pool_release(void * context) {
+    rb_pool * pool = context;
+    rb_chunk * next;
+    rb_pool_ref * ref;
 
-            if (sibling->color == RB_RED) {
-                // Case 1: sibling is red
+    rb_pool_lock(pool);
+    unsigned refs = --pool->refs;
+    rb_pool_unlock(pool);
 
-                sibling->color = RB_BLACK;
-                parent->color = RB_RED;
-                rb_rotate_left(tree, parent);
-                sibling = parent->right;
-            }
+    if (refs > 0) {
+        return;
+    }
 
-            if (sibling->color == RB_BLACK && (sibling->left == NULL || sibling->left->color == RB_BLACK) && (sibling->right == NULL || sibling->right->color == RB_BLACK)) {
-                // Case 2: sibling is black and both nephews are black
+    for (rb_chunk * chunk = pool->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
 
-                sibling->color = RB_RED;
-                node = parent;
-                parent = parent->parent;
+    for (rb_pool_ref * r = pool->retained; r != NULL; r = ref) {
+        ref = r->next;
+        rb_pool_release(r->pool);
+        free(r);
+    }
 
-            } else {
-                if (sibling->right == NULL || sibling->right->color == RB_BLACK) {
-                    // Case 3: Sibling is black, left nephew is red and right nephew is black
+    if (pool->lock != NULL) {
+        pthread_mutex_destroy(pool->lock);
+        free(pool->lock);
+    }
 
-                    sibling->left->color = RB_BLACK;
-                    sibling->color = RB_RED;
-                    rb_rotate_right(tree, sibling);
-                    sibling = parent->right;
-                }
+    free(pool);
+}
 
-                // Case 4: Sibling is black, right nephew is red
+/**
+ * @brief Allocate a block with the standard library
+ *
+ * @param context Unused.
+ * @param size Block size.
+ * @return Pointer to a newly allocated block.
+ */
 
-                sibling->color = parent->color;
-                parent->color = RB_BLACK;
-                sibling->right->color = RB_BLACK;
-                rb_rotate_left(tree, parent);
+static void * rb_malloc(void * context, size_t size) {
+    (void)context;
+    return malloc(size);
+}
 
-                break;
-            }
-        } else {
-            rb_node * sibling = parent->left;
+/**
+ * @brief Free a block with the standard library
+ *
+ * @param context Unused.
+ * @param ptr Pointer to the block.
+ * @param size Unused.
+ */
 
-            if (sibling->color == RB_RED) {
-                // Case 1b: sibling is red
+static void rb_mfree(void * context, void * ptr, size_t size) {
+    (void)context;
+    (void)size;
+    free(ptr);
+}
 
-                sibling->color = RB_BLACK;
-                parent->color = RB_RED;
-                rb_rotate_right(tree, parent);
-                sibling = parent->left;
-            }
+/**
+ * @brief Get the size of a node block
+ *
+ * @param length Key size, as returned by rb_key_size.
+ * @return Number of bytes to allocate for the node and its key.
+ */
 
-            if (sibling->color == RB_BLACK && (sibling->left == NULL || sibling->left->color == RB_BLACK) && (sibling->right == NULL || sibling->right->color == RB_BLACK)) {
-                // Case 2b: sibling is black and both nephews are black
+static size_t rb_node_size(size_t length) {
+    return offsetof(rb_node, key) + length;
+}
 
-                sibling->color = RB_RED;
-                node = parent;
-                parent = parent->parent;
-            } else {
-                if (sibling->left == NULL || sibling->left->color == RB_BLACK) {
-                    // Case 3b: Sibling is black, left nephew is red and right nephew is black
+/**
+ * @brief Get the size of a key
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key.
+ * @return Number of bytes of key, including the terminating null byte of
+ *         string keys.
+ */
 
-                    sibling->right->color = RB_BLACK;
-                    sibling->color = RB_RED;
-                    rb_rotate_left(tree, sibling);
-                    sibling = parent->left;
-                }
+static size_t rb_key_size(const rb_tree * tree, const char * key) {
+    return tree->key_size ? tree->key_size : strlen(key) + 1;
+}
 
-                // Case 4b: Sibling is black, right nephew is red
+/**
+ * @brief Compare two keys
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param a First key.
+ * @param b Second key.
+ * @return Negative, zero or positive if a is lower than, equal to or greater
+ *         than b.
+ */
 
-                sibling->color = parent->color;
-                parent->color = RB_BLACK;
-                sibling->left->color = RB_BLACK;
-                rb_rotate_right(tree, parent);
+static inline int rb_cmp(const rb_tree * tree, const char * a, const char * b) {
+    RB_STAT(tree, comparisons, 1);
 
-                break;
-            }
-        }
+    switch (tree->key_type) {
+    case RB_KEY_STRING:
+        return strcmp(a, b);
+
+    case RB_KEY_U64: {
+        uint64_t x, y;
+        memcpy(&x, a, sizeof(x));
+        memcpy(&y, b, sizeof(y));
+        return (x > y) - (x < y);
     }
 
-    if (node != NULL) {
-        node->color = RB_BLACK;
+    case RB_KEY_BINARY:
+        return memcmp(a, b, tree->key_size);
+
+    default:
+        return tree->compare(a, b);
     }
 }
 
 /**
- * @brief Get all the keys in a subtree
+ * @brief Get the cached prefix of a key
  *
- * @param node Pointer to a red-black tree node.
- * @param array Pointer to the target string array.
- * @param size[in,out] Pointer to the current size of the array.
- * @pre array is expected to be size cells long.
- * @post array is reallocated to size+2 cells long.
- * @post array is no longer valid after calling this function.
- * @return Newly allocated null-terminated array of keys.
+ * String and binary keys yield their first 8 bytes as a big-endian integer,
+ * zero-padded, so that integer order matches strcmp and memcmp order. U64
+ * keys yield their value. Custom-ordered keys have no prefix.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key.
+ * @return Key prefix.
  */
 
-static char ** rb_keys(rb_node * node, char ** array, unsigned * size) {
-    if (node->left != NULL) {
-        array = rb_keys(node->left, array, size);
-    }
+static uint64_t rb_prefix(const rb_tree * tree, const char * key) {
+    const unsigned char * bytes = (const unsigned char *)key;
+    uint64_t prefix = 0;
+
+    switch (tree->key_type) {
+    case RB_KEY_STRING:
+        for (int i = 0; i < 8 && bytes[i] != '\0'; i++) {
+            prefix |= (uint64_t)bytes[i] << (56 - 8 * i);
+        }
 
-    array = realloc(array, sizeof(char *) * (*size + 2));
-    array[(*size)++] = strdup(node->key);
+        break;
 
-    if (node->right != NULL) {
-        array = rb_keys(node->right, array, size);
+    case RB_KEY_U64:
+        memcpy(&prefix, key, sizeof(prefix));
+        break;
+
+    case RB_KEY_BINARY:
+        for (size_t i = 0; i < 8 && i < tree->key_size; i++) {
+            prefix |= (uint64_t)bytes[i] << (56 - 8 * i);
+        }
+
+        break;
+
+    default:
+        break;
     }
 
-    return array;
+    return prefix;
 }
 
 /**
- * @brief Get all the keys from the subtree within a range
+ * @brief Compare a key with the key of a node
+ *
+ * The cached prefixes decide most comparisons. The key bytes are only read
+ * when both prefixes match.
  *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key.
+ * @param prefix Prefix of key, as returned by rb_prefix.
  * @param node Pointer to a red-black tree node.
- * @param min Minimum key.
- * @param max Maximum key.
- * @param array Pointer to the target string array.
- * @param size[in,out] Pointer to the current size of the array.
- * @pre array is expected to be size cells long.
- * @post array is reallocated to size+2 cells long.
- * @post array is no longer valid after calling this function.
- * @return Newly allocated null-terminated array of keys.
+ * @return Negative, zero or positive if key is lower than, equal to or
+ *         greater than the node key.
  */
 
-static char ** rb_range(rb_node * node, const char * min, const char * max, char ** array, unsigned * size) {
-    int cmp_min = strcmp(node->key, min);
-    int cmp_max = strcmp(node->key, max);
+static inline int rb_cmp_node(const rb_tree * tree, const char * key, uint64_t prefix, const rb_node * node) {
+    RB_STAT(tree, comparisons, 1);
 
-    if (node->left != NULL && cmp_min > 0) {
-        // node > min
-        array = rb_range(node->left, min, max, array, size);
+    if (tree->key_type == RB_KEY_CUSTOM) {
+        return tree->compare(key, node->key);
     }
 
-    if (cmp_min >= 0 && cmp_max <= 0) {
-        // min <= node <= max
-        array = realloc(array, sizeof(char *) * (*size + 2));
-        array[(*size)++] = strdup(node->key);
+    if (prefix != node->prefix) {
+        return prefix < node->prefix ? -1 : 1;
     }
 
-    if (node->right != NULL && cmp_max < 0) {
-        // node < min
-        array = rb_range(node->right, min, max, array, size);
-    }
+    switch (tree->key_type) {
+    case RB_KEY_STRING:
+        // A null byte in the prefix means that both strings ended
+        return (prefix & 0xFF) ? strcmp(key + 8, node->key + 8) : 0;
 
-    return array;
+    case RB_KEY_BINARY:
+        return tree->key_size > 8 ? memcmp(key + 8, node->key + 8, tree->key_size - 8) : 0;
+
+    default:
+        return 0;
+    }
 }
 
 /**
- * @brief Get the black depth of a red-black subtree
- *
- * The black depth of a node is the number of black nodes from it to any leaf,
- * including null leafs (that are black) and excluding the node itself.
- *
- * This function is test-oriented: it checks that all possible paths from the
- * root to every leaf matches, and returns the length of this path.
+ * @brief Get the parent of a node
  *
  * @param node Pointer to a red-black tree node.
- * @return Number of black nodes from this node.
- * @retval -1 The subtree is unbalanced. This would mean a bug.
+ * @return Pointer to the parent node, or NULL if node is the root.
  */
 
-static int rb_black_depth(rb_node * node) {
-    if (node == NULL) {
-        return 1;
-    }
-
-    int d_left = rb_black_depth(node->left);
-    int d_right = rb_black_depth(node->right);
-
-    if (d_left != d_right) {
-        return -1;
-    }
-
-    return d_left + (node->color == RB_BLACK);
+static inline rb_node * rb_parent(const rb_node * node) {
+    return (rb_node *)(node->parent_color & ~(uintptr_t)1);
 }
 
 /**
- * @brief Get the size of a subtree
- *
- * This function is recursive: 1 + rb_size(left subtree) + rb_size(right subtree).
+ * @brief Get the color of a node
  *
  * @param node Pointer to a red-black tree node.
- * @return Number of nodes in the subtree.
+ * @return Node color.
  */
 
-unsigned rb_size(rb_node * node) {
-    return (node->left ? rb_size(node->left) : 0) + 1 + (node->right ? rb_size(node->right) : 0);
+static inline rb_color rb_node_color(const rb_node * node) {
+    return (rb_color)(node->parent_color & 1);
 }
 
-/* Public functions ***********************************************************/
-
-// Create a red-black tree
+/**
+ * @brief Set the parent of a node, keeping its color
+ *
+ * @param node Pointer to a red-black tree node.
+ * @param parent Pointer to the new parent, or NULL.
+ */
 
-rb_tree * rbtree_init() {
-    return calloc(1, sizeof(rb_tree));
+static inline void rb_set_parent(rb_node * node, rb_node * parent) {
+    node->parent_color = (uintptr_t)parent | (node->parent_color & 1);
 }
 
-// Free a red-black tree
+/**
+ * @brief Set the color of a node, keeping its parent
+ *
+ * @param node Pointer to a red-black tree node.
+ * @param color New color.
+ */
 
-void rbtree_destroy(rb_tree * tree) {
-    if (tree == NULL) {
-        return;
-    }
+static inline void rb_set_color(rb_node * node, rb_color color) {
+    node->parent_color = (node->parent_color & ~(uintptr_t)1) | color;
+}
 
-    if (tree->root != NULL) {
-        rb_destroy(tree->root, tree->dispose);
-    }
+/**
+ * @brief Change the color of a node while rebalancing
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to a red-black tree node.
+ * @param color New color.
+ */
 
-    free(tree);
+static inline void rb_recolor(rb_tree * tree, rb_node * node, rb_color color) {
+    RB_STAT(tree, recolorings, rb_node_color(node) != color);
+    rb_set_color(node, color);
 }
 
-// Set free function to dispose elements
-
+/**
+ * @brief Create and initialize a red-black tree node
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key. It will be copied into the node.
+ * @param value Data value.
+ * @return Pointer to a newly created node.
+ */
+
+static rb_node * rb_init(rb_tree * tree, const char * key, void * value) {
+    const rb_allocator * allocator = &tree->allocator;
+    size_t length = rb_key_size(tree, key);
+    rb_node * node = allocator->alloc(allocator->context, rb_node_size(length));
+
+    RB_STAT(tree, allocations, 1);
+    RB_STAT(tree, bytes, rb_node_size(length));
+    memcpy(node->key, key, length);
+    node->prefix = rb_prefix(tree, key);
+    node->value = value;
+    node->parent_color = RB_RED;
+    node->left = NULL;
+    node->right = NULL;
+#ifdef RBTREE_THREADED
+    node->next = NULL;
+    node->prev = NULL;
+#endif
+    node->size = 1;
+    return node;
+}
+
+/**
+ * @brief Free a node and its key
+ *
+ * The value is not disposed.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to a red-black tree node.
+ */
+
+static void rb_free(rb_tree * tree, rb_node * node) {
+    const rb_allocator * allocator = &tree->allocator;
+    size_t size = rb_node_size(rb_key_size(tree, node->key));
+
+    RB_STAT(tree, frees, 1);
+    RB_STAT(tree, bytes, -(uint64_t)size);
+    tree->epoch++;
+    allocator->free(allocator->context, node, size);
+}
+
+/**
+ * @brief Free up to a number of nodes of a tree
+ *
+ * Nodes are freed in post-order, without recursion: the walk descends to a
+ * leaf, frees it, unlinks it from its parent and climbs back, so every call
+ * resumes from the root where the previous one stopped.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param budget Maximum number of nodes to free.
+ * @param recycle Free nodes even if the allocator has a release function.
+ * @post If the tree has a dispose function, the values are freed.
+ * @post If the allocator has a release function and recycle is 0, nodes are
+ *       not freed.
+ * @post If all nodes were freed, the root is set to NULL. Otherwise, the
+ *       tree is no longer balanced and subtree sizes are stale.
+ */
+
+static void rb_destroy(rb_tree * tree, unsigned budget, int recycle) {
+    rb_node * node = tree->root;
+
+    while (node != NULL && budget > 0) {
+        if (node->left != NULL) {
+            node = node->left;
+        } else if (node->right != NULL) {
+            node = node->right;
+        } else {
+            rb_node * parent = rb_parent(node);
+
+            if (parent == NULL) {
+                tree->root = NULL;
+            } else if (node == parent->left) {
+                parent->left = NULL;
+            } else {
+                parent->right = NULL;
+            }
+
+            if (node->value != NULL && tree->dispose != NULL) {
+                tree->dispose(node->value);
+            }
+
+            if (recycle || tree->allocator.release == NULL) {
+                rb_free(tree, node);
+            }
+
+            node = parent;
+            budget--;
+        }
+    }
+}
+
+/**
+ * @brief Find a node from a tree
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param start Root of the subtree to search: the tree root, or a node whose
+ *              subtree would contain the key.
+ * @param key Data key (search criteria).
+ * @return Pointer to the node storing the key, if found.
+ * @retval NULL Key not found.
+ */
+
+static rb_node * rb_get(const rb_tree * tree, rb_node * start, const char * key) {
+    rb_node * node = start;
+    uint64_t prefix = rb_prefix(tree, key);
+
+    while (node != NULL) {
+        int cmp = rb_cmp_node(tree, key, prefix, node);
+
+        if (cmp == 0) {
+            break;
+        }
+
+        node = cmp < 0 ? node->left : node->right;
+    }
+
+    return node;
+}
+
+/**
+ * @brief Get the node with the minimum key from a subtree
+ *
+ * Return the leftmost node of the subtree.
+ *
+ * @param node Pointer to a red-black tree node.
+ * @return Pointer to the node storing the minimum key.
+ */
+
+static rb_node * rb_min(rb_node * node) {
+    rb_node * t;
+    for (t = node; t->left != NULL; t = t->left);
+    return t;
+}
+
+/**
+ * @brief Get the node with the maximum key from a subtree
+ *
+ * Return the rightmost node of the subtree.
+ *
+ * @param node Pointer to a red-black tree node.
+ * @return Pointer to the node storing the maximum key.
+ */
+
+static rb_node * rb_max(rb_node * node) {
+    rb_node * t;
+    for (t = node; t->right != NULL; t = t->right);
+    return t;
+}
+
+/**
+ * @brief Find the leftmost and rightmost nodes again after a bulk change
+ *
+ * @param tree Pointer to a red-black tree.
+ */
+
+static void rb_ends(rb_tree * tree) {
+    tree->first = tree->root ? rb_min(tree->root) : NULL;
+    tree->last = tree->root ? rb_max(tree->root) : NULL;
+}
+
+/**
+ * @brief Get the size of a subtree
+ *
+ * @param node Pointer to a red-black tree node, or NULL.
+ * @return Number of nodes in the subtree.
+ */
+
+static unsigned rb_size(const rb_node * node) {
+    return node ? node->size : 0;
+}
+
+/**
+ * @brief Get the uncle of a node
+ *
+ * @param node Pointer to a red-black tree node.
+ * @return Pointer to the sibling of node's parent.
+ */
+
+static rb_node * rb_uncle(rb_node * node) {
+    rb_node * parent = rb_parent(node);
+    rb_node * gp;
+    return (parent && (gp = rb_parent(parent))) ? (parent == gp->left) ? gp->right : gp->left : NULL;
+}
+
+/**
+ * @brief Rotate a subtree to left
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to the pivot node.
+ */
+
+static void rb_rotate_left(rb_tree * tree, rb_node * node) {
+    rb_node * t = node->right;
+
+    // The left subtree of node goes one level down, and the right one of t, one level up
+    RB_STAT(tree, rotations, 1);
+    RB_STAT(tree, path_length, (uint64_t)rb_size(node->left) - rb_size(t->right));
+
+    if (rb_parent(node) == NULL) {
+        tree->root = t;
+    } else {
+        if (node == rb_parent(node)->left) {
+            rb_parent(node)->left = t;
+        } else {
+            rb_parent(node)->right = t;
+        }
+    }
+
+    if (t->left != NULL) {
+        rb_set_parent(t->left, node);
+    }
+
+    node->right = t->left;
+    t->left = node;
+    rb_set_parent(t, rb_parent(node));
+    rb_set_parent(node, t);
+
+    t->size = node->size;
+    node->size = rb_size(node->left) + 1 + rb_size(node->right);
+}
+
+/**
+ * @brief Rotate a subtree to right
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to the pivot node.
+ */
+
+static void rb_rotate_right(rb_tree * tree, rb_node * node) {
+    rb_node * t = node->left;
+
+    RB_STAT(tree, rotations, 1);
+    RB_STAT(tree, path_length, (uint64_t)rb_size(node->right) - rb_size(t->left));
+
+    if (rb_parent(node) == NULL) {
+        tree->root = t;
+    } else {
+        if (node == rb_parent(node)->left) {
+            rb_parent(node)->left = t;
+        } else {
+            rb_parent(node)->right = t;
+        }
+    }
+
+    if (t->right != NULL) {
+        rb_set_parent(t->right, node);
+    }
+
+    node->left = t->right;
+    t->right = node;
+    rb_set_parent(t, rb_parent(node));
+    rb_set_parent(node, t);
+
+    t->size = node->size;
+    node->size = rb_size(node->left) + 1 + rb_size(node->right);
+}
+
+/**
+ * @brief Balance a tree after an insertion
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to the node that was inserted.
+ * @return 1 if the root was red, so the black height of the tree grew, or 0.
+ */
+
+static int rb_balance_insert(rb_tree * tree, rb_node * node) {
+    while (rb_parent(node) && rb_node_color(rb_parent(node)) == RB_RED) {
+        rb_node * uncle = rb_uncle(node);
+        RB_STAT(tree, insert_fixups, 1);
+
+        if (uncle != NULL && rb_node_color(uncle) == RB_RED) {
+            rb_recolor(tree, rb_parent(node), RB_BLACK);
+            rb_recolor(tree, uncle, RB_BLACK);
+            rb_recolor(tree, rb_parent(rb_parent(node)), RB_RED);
+
+            node = rb_parent(rb_parent(node));
+        } else {
+            if (rb_parent(node) == rb_parent(rb_parent(node))->left) {
+                if (node == rb_parent(node)->right) {
+                    node = rb_parent(node);
+                    rb_rotate_left(tree, node);
+                }
+
+                rb_recolor(tree, rb_parent(node), RB_BLACK);
+                rb_recolor(tree, rb_parent(rb_parent(node)), RB_RED);
+
+                rb_rotate_right(tree, rb_parent(rb_parent(node)));
+            } else {
+                if (node == rb_parent(node)->left) {
+                    node = rb_parent(node);
+                    rb_rotate_right(tree, node);
+                }
+
+                rb_recolor(tree, rb_parent(node), RB_BLACK);
+                rb_recolor(tree, rb_parent(rb_parent(node)), RB_RED);
+
+                rb_rotate_left(tree, rb_parent(rb_parent(node)));
+            }
+        }
+    }
+
+    int grew = rb_node_color(tree->root) == RB_RED;
+    rb_recolor(tree, tree->root, RB_BLACK);
+    return grew;
+}
+
+/**
+ * @brief Balance a tree after a deletion
+ *
+ * @param tree Pointer to the red-black tree.
+ * @param node Pointer to the node that was deleted.
+ * @param parent Pointer to the parent of node.
+ */
+
+static void rb_balance_delete(rb_tree * tree, rb_node * node, rb_node * parent) {
+    while (parent != NULL && (node == NULL || rb_node_color(node) == RB_BLACK)) {
+        RB_STAT(tree, delete_fixups, 1);
+
+        if (node == parent->left) {
+            rb_node * sibling = parent->right;
+
+            if (rb_node_color(sibling) == RB_RED) {
+                // Case 1: sibling is red
+
+                rb_recolor(tree, sibling, RB_BLACK);
+                rb_recolor(tree, parent, RB_RED);
+                rb_rotate_left(tree, parent);
+                sibling = parent->right;
+            }
+
+            if (rb_node_color(sibling) == RB_BLACK && (sibling->left == NULL || rb_node_color(sibling->left) == RB_BLACK) && (sibling->right == NULL || rb_node_color(sibling->right) == RB_BLACK)) {
+                // Case 2: sibling is black and both nephews are black
+
+                rb_recolor(tree, sibling, RB_RED);
+                node = parent;
+                parent = rb_parent(parent);
+
+            } else {
+                if (sibling->right == NULL || rb_node_color(sibling->right) == RB_BLACK) {
+                    // Case 3: Sibling is black, left nephew is red and right nephew is black
+
+                    rb_recolor(tree, sibling->left, RB_BLACK);
+                    rb_recolor(tree, sibling, RB_RED);
+                    rb_rotate_right(tree, sibling);
+                    sibling = parent->right;
+                }
+
+                // Case 4: Sibling is black, right nephew is red
+
+                rb_recolor(tree, sibling, rb_node_color(parent));
+                rb_recolor(tree, parent, RB_BLACK);
+                rb_recolor(tree, sibling->right, RB_BLACK);
+                rb_rotate_left(tree, parent);
+
+                break;
+            }
+        } else {
+            rb_node * sibling = parent->left;
+
+            if (rb_node_color(sibling) == RB_RED) {
+                // Case 1b: sibling is red
+
+                rb_recolor(tree, sibling, RB_BLACK);
+                rb_recolor(tree, parent, RB_RED);
+                rb_rotate_right(tree, parent);
+                sibling = parent->left;
+            }
+
+            if (rb_node_color(sibling) == RB_BLACK && (sibling->left == NULL || rb_node_color(sibling->left) == RB_BLACK) && (sibling->right == NULL || rb_node_color(sibling->right) == RB_BLACK)) {
+                // Case 2b: sibling is black and both nephews are black
+
+                rb_recolor(tree, sibling, RB_RED);
+                node = parent;
+                parent = rb_parent(parent);
+            } else {
+                if (sibling->left == NULL || rb_node_color(sibling->left) == RB_BLACK) {
+                    // Case 3b: Sibling is black, left nephew is red and right nephew is black
+
+                    rb_recolor(tree, sibling->right, RB_BLACK);
+                    rb_recolor(tree, sibling, RB_RED);
+                    rb_rotate_left(tree, sibling);
+                    sibling = parent->left;
+                }
+
+                // Case 4b: Sibling is black, right nephew is red
+
+                rb_recolor(tree, sibling, rb_node_color(parent));
+                rb_recolor(tree, parent, RB_BLACK);
+                rb_recolor(tree, sibling->left, RB_BLACK);
+                rb_rotate_right(tree, parent);
+
+                break;
+            }
+        }
+    }
+
+    if (node != NULL) {
+        rb_recolor(tree, node, RB_BLACK);
+    }
+}
+
+/**
+ * @brief Get the in-order successor of a node
+ *
+ * Threaded trees follow the link, and the others climb the tree.
+ *
+ * @param node Pointer to a red-black tree node.
+ * @return Pointer to the next node.
+ * @retval NULL node holds the maximum key.
+ */
+
+static rb_node * rb_next(rb_node * node) {
+#ifdef RBTREE_THREADED
+    return node->next;
+#else
+    if (node->right != NULL) {
+        return rb_min(node->right);
+    }
+
+    while (rb_parent(node) != NULL && node == rb_parent(node)->right) {
+        node = rb_parent(node);
+    }
+
+    return rb_parent(node);
+#endif
+}
+
+/**
+ * @brief Get the in-order predecessor of a node
+ *
+ * @param node Pointer to a red-black tree node.
+ * @return Pointer to the previous node.
+ * @retval NULL node holds the minimum key.
+ */
+
+static rb_node * rb_prev(rb_node * node) {
+#ifdef RBTREE_THREADED
+    return node->prev;
+#else
+    if (node->left != NULL) {
+        return rb_max(node->left);
+    }
+
+    while (rb_parent(node) != NULL && node == rb_parent(node)->left) {
+        node = rb_parent(node);
+    }
+
+    return rb_parent(node);
+#endif
+}
+
+#ifdef RBTREE_THREADED
+
+/**
+ * @brief Point the neighbors of a node back to it
+ *
+ * @param node Pointer to a node whose next and prev links are set.
+ */
+
+static void rb_relink(rb_node * node) {
+    if (node->prev != NULL) {
+        node->prev->next = node;
+    }
+
+    if (node->next != NULL) {
+        node->next->prev = node;
+    }
+}
+
+/**
+ * @brief Set the next and prev links of all the nodes of a tree
+ *
+ * The tree is walked in order through the parent pointers, without
+ * recursion.
+ *
+ * @param tree Pointer to a red-black tree.
+ */
+
+static void rb_thread(rb_tree * tree) {
+    rb_node * prev = NULL;
+    rb_node * node = tree->root;
+    rb_node * last = NULL;
+
+    while (node != NULL) {
+        rb_node * parent = rb_parent(node);
+        rb_node * next;
+
+        if (prev == parent && node->left != NULL) {
+            next = node->left;
+        } else if (prev == parent || prev == node->left) {
+            node->prev = last;
+
+            if (last != NULL) {
+                last->next = node;
+            }
+
+            last = node;
+            next = node->right ? node->right : parent;
+        } else {
+            next = parent;
+        }
+
+        prev = node;
+        node = next;
+    }
+
+    if (last != NULL) {
+        last->next = NULL;
+    }
+}
+
+#endif
+
+/**
+ * @brief Find the node with the lowest key not lower than a key
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param start Root of the subtree to search: the tree root, or a node whose
+ *              subtree would contain the key.
+ * @param key Data key.
+ * @return Pointer to the first node of the subtree whose key is greater than
+ *         or equal to key.
+ * @retval NULL All keys in the subtree are lower than key.
+ */
+
+static rb_node * rb_lower_bound(const rb_tree * tree, rb_node * start, const char * key) {
+    rb_node * node = start;
+    rb_node * bound = NULL;
+    uint64_t prefix = rb_prefix(tree, key);
+
+    while (node != NULL) {
+        int cmp = rb_cmp_node(tree, key, prefix, node);
+
+        if (cmp == 0) {
+            return node;
+        } else if (cmp < 0) {
+            bound = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return bound;
+}
+
+/**
+ * @brief Copy the keys of a sequence of nodes
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to the first node, or NULL.
+ * @param count Number of nodes to copy.
+ * @return Newly allocated null-terminated array of keys.
+ */
+
+static char ** rb_keys(const rb_tree * tree, rb_node * node, unsigned count) {
+    char ** array = malloc(sizeof(char *) * (count + 1));
+
+    for (unsigned i = 0; i < count; i++, node = rb_next(node)) {
+        size_t size = rb_key_size(tree, node->key);
+        array[i] = memcpy(malloc(size), node->key, size);
+    }
+
+    array[count] = NULL;
+    return array;
+}
+
+/**
+ * @brief Get the black depth of a red-black subtree
+ *
+ * The black depth of a node is the number of black nodes from it to any leaf,
+ * including the node itself and null leafs (that are black).
+ *
+ * This function is test-oriented: it checks that all possible paths from the
+ * root to every leaf matches, and returns the length of this path. The
+ * subtree is walked through the parent pointers, without recursion.
+ *
+ * @param root Pointer to a red-black tree node.
+ * @return Number of black nodes from this node.
+ * @retval -1 The subtree is unbalanced. This would mean a bug.
+ */
+
+static int rb_black_depth(const rb_node * root) {
+    const rb_node * stop = root ? rb_parent(root) : NULL;
+    const rb_node * prev = stop;
+    const rb_node * node = root;
+    int expected = 0;
+    int depth = 0;
+
+    while (node != NULL && node != stop) {
+        const rb_node * parent = rb_parent(node);
+        const rb_node * next;
+
+        if (prev == parent) {
+            depth += rb_node_color(node) == RB_BLACK;
+
+            if (node->left == NULL || node->right == NULL) {
+                // Null leafs are black
+
+                if (expected == 0) {
+                    expected = depth + 1;
+                } else if (expected != depth + 1) {
+                    return -1;
+                }
+            }
+
+            next = node->left ? node->left : node->right ? node->right : parent;
+        } else if (prev == node->left && node->right != NULL) {
+            next = node->right;
+        } else {
+            next = parent;
+        }
+
+        if (next == parent) {
+            depth -= rb_node_color(node) == RB_BLACK;
+        }
+
+        prev = node;
+        node = next;
+    }
+
+    return expected ? expected : 1;
+}
+
+static unsigned rb_image_rank(const rb_tree * tree, const char * key, int inclusive);
+
+/**
+ * @brief Count the keys of a tree that precede a key
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key.
+ * @param inclusive If nonzero, also count a key equal to key.
+ * @return Number of keys lower than key (or lower or equal, if inclusive).
+ */
+
+static unsigned rb_rank(const rb_tree * tree, const char * key, int inclusive) {
+    if (tree->image != NULL) {
+        return rb_image_rank(tree, key, inclusive);
+    }
+
+    const rb_node * node = tree->root;
+    unsigned rank = 0;
+    uint64_t prefix = rb_prefix(tree, key);
+
+    while (node != NULL) {
+        int cmp = rb_cmp_node(tree, key, prefix, node);
+
+        if (cmp < 0 || (cmp == 0 && !inclusive)) {
+            node = node->left;
+        } else {
+            rank += rb_size(node->left) + 1;
+            node = node->right;
+        }
+    }
+
+    return rank;
+}
+
+/**
+ * @brief Build a balanced subtree from a sorted array
+ *
+ * Nodes are allocated in pre-order. Every node above red_depth is black, and
+ * nodes at red_depth (the incomplete bottom level) are red.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param keys Array of sorted keys.
+ * @param values Array of values, or NULL.
+ * @param lo First index of the subtree.
+ * @param hi Index past the last element of the subtree.
+ * @param depth Depth of the subtree root.
+ * @param red_depth Depth of the red level.
+ * @param parent Pointer to the parent node.
+ * @return Pointer to the subtree root, or NULL if it is empty.
+ */
+
+static rb_node * rb_build(rb_tree * tree, char * const * keys, void * const * values, unsigned lo, unsigned hi, unsigned depth, unsigned red_depth, rb_node * parent) {
+    if (lo == hi) {
+        return NULL;
+    }
+
+    unsigned mid = lo + (hi - lo) / 2;
+    rb_node * node = rb_init(tree, keys[mid], values ? values[mid] : NULL);
+
+    RB_STAT(tree, path_length, depth);
+    rb_set_color(node, depth == red_depth ? RB_RED : RB_BLACK);
+    rb_set_parent(node, parent);
+    node->size = hi - lo;
+    node->left = rb_build(tree, keys, values, lo, mid, depth + 1, red_depth, node);
+    node->right = rb_build(tree, keys, values, mid + 1, hi, depth + 1, red_depth, node);
+    return node;
+}
+
+/**
+ * @brief Find the node at a given position
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param index Zero-based position, in key order.
+ * @return Pointer to the node at that position.
+ * @retval NULL index is out of range.
+ */
+
+static rb_node * rb_select(const rb_tree * tree, unsigned index) {
+    rb_node * node = tree->root;
+
+    while (node != NULL) {
+        unsigned left = rb_size(node->left);
+
+        if (index == left) {
+            break;
+        } else if (index < left) {
+            node = node->left;
+        } else {
+            index -= left + 1;
+            node = node->right;
+        }
+    }
+
+    return node;
+}
+
+/**
+ * @brief Count the keys of a tree within a range
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param min Minimum key.
+ * @param max Maximum key.
+ * @return Number of keys in the closed range [min, max].
+ */
+
+static unsigned rb_count_range(const rb_tree * tree, const char * min, const char * max) {
+    unsigned lower = rb_rank(tree, min, 0);
+    unsigned upper = rb_rank(tree, max, 1);
+    return upper > lower ? upper - lower : 0;
+}
+
+static void rb_snap_added(rb_tree * tree, const char * key);
+static void rb_snap_keep(rb_tree * tree, const rb_node * node);
+
+/**
+ * @brief Find a key, or insert it if missing, searching from a given node
+ *
+ * The search and the insertion share a single descent, and the node is
+ * allocated only if the key is not found.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param start Node to start the search from: the root, or a node whose
+ *              subtree would contain the key.
+ * @param key Data key.
+ * @param value Data value for a new node.
+ * @param[out] inserted Set to 1 if a node was inserted, or 0 if it was found.
+ * @return Pointer to the node holding the key.
+ */
+
+static rb_node * rb_insert(rb_tree * tree, rb_node * start, const char * key, void * value, int * inserted) {
+    rb_node * parent = NULL;
+    uint64_t prefix = rb_prefix(tree, key);
+    int cmp = 0;
+
+    for (rb_node * t = start; t != NULL; t = cmp < 0 ? t->left : t->right) {
+        parent = t;
+        cmp = rb_cmp_node(tree, key, prefix, t);
+
+        if (cmp == 0) {
+            *inserted = 0;
+            return t;
+        }
+    }
+
+    rb_node * node = rb_init(tree, key, value);
+
+    if (parent == NULL) {
+        tree->root = node;
+    } else if (cmp < 0) {
+        parent->left = node;
+    } else {
+        parent->right = node;
+    }
+
+    rb_set_parent(node, parent);
+
+#ifdef RBTREE_THREADED
+    // A new leaf sits right before or after its parent
+    if (parent != NULL) {
+        node->prev = cmp < 0 ? parent->prev : parent;
+        node->next = cmp < 0 ? parent : parent->next;
+        rb_relink(node);
+    }
+#endif
+
+    if (tree->first == NULL || (parent == tree->first && cmp < 0)) {
+        tree->first = node;
+    }
+
+    if (tree->last == NULL || (parent == tree->last && cmp > 0)) {
+        tree->last = node;
+    }
+
+    // Every ancestor adds one level to the depth of node
+    for (rb_node * p = parent; p != NULL; p = rb_parent(p)) {
+        RB_STAT(tree, path_length, 1);
+        p->size++;
+    }
+
+    rb_balance_insert(tree, node);
+    rb_snap_added(tree, node->key);
+    *inserted = 1;
+    return node;
+}
+
+/**
+ * @brief Unlink a node from the tree and rebalance it
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to a node of the tree. It is neither freed nor reset.
+ */
+
+static void rb_unlink(rb_tree * tree, rb_node * node) {
+    if (node == tree->first) {
+        tree->first = rb_next(node);
+    }
+
+    if (node == tree->last) {
+        tree->last = rb_prev(node);
+    }
+
+#ifdef RBTREE_THREADED
+    // The links of node are kept, so that rb_relink can put it back
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    }
+
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+#endif
+
+    // Succesor: node that will be actually unlinked
+    rb_node * s = (node->left != NULL && node->right != NULL) ? rb_min(node->right) : node;
+    rb_node * t = (s->left != NULL) ? s->left : s->right;
+    rb_node * parent = rb_parent(s);
+    rb_color color = rb_node_color(s);
+
+    if (rb_parent(s) == NULL) {
+        tree->root = t;
+    } else if (s == rb_parent(s)->left) {
+        rb_parent(s)->left = t;
+    } else {
+        rb_parent(s)->right = t;
+    }
+
+    if (t != NULL) {
+        rb_set_parent(t, rb_parent(s));
+    }
+
+    // The subtree of t goes one level up. If s replaces node, it takes the
+    // depth of node, so the depth of s is lost either way.
+    RB_STAT(tree, path_length, -(uint64_t)rb_size(t));
+
+    for (rb_node * p = parent; p != NULL; p = rb_parent(p)) {
+        RB_STAT(tree, path_length, -1);
+        p->size--;
+    }
+
+    if (node != s) {
+        // Move successor into node's place. Keys live inside nodes, so they cannot be swapped.
+
+        if (parent == node) {
+            parent = s;
+        }
+
+        rb_set_color(s, rb_node_color(node));
+        rb_set_parent(s, rb_parent(node));
+        s->left = node->left;
+        s->right = node->right;
+        s->size = node->size;
+
+        if (rb_parent(node) == NULL) {
+            tree->root = s;
+        } else if (node == rb_parent(node)->left) {
+            rb_parent(node)->left = s;
+        } else {
+            rb_parent(node)->right = s;
+        }
+
+        if (s->left != NULL) {
+            rb_set_parent(s->left, s);
+        }
+
+        if (s->right != NULL) {
+            rb_set_parent(s->right, s);
+        }
+    }
+
+    if (color == RB_BLACK) {
+        rb_balance_delete(tree, t, parent);
+    }
+}
+
+/**
+ * @brief Unlink a node from the tree and free it
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to a node of the tree.
+ * @post The value is disposed if a dispose function was defined.
+ */
+
+static void rb_delete(rb_tree * tree, rb_node * node) {
+    rb_snap_keep(tree, node);
+    rb_unlink(tree, node);
+
+    if (node->value && tree->dispose) {
+        tree->dispose(node->value);
+    }
+
+    rb_free(tree, node);
+}
+
+/**
+ * @brief Climb from a finger to the subtree that would contain a key
+ *
+ * Return the lowest ancestor of the finger (or the finger itself) whose key
+ * range also covers key, so that a descent from it is equivalent to a descent
+ * from the root. The bound of a subtree on the side of key is the key of the
+ * nearest ancestor that holds it on the other side, so only those ancestors
+ * are compared. The cost is logarithmic in the distance between both keys.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to the finger node.
+ * @param key Data key.
+ * @return Pointer to the node to start the search from.
+ */
+
+static rb_node * rb_finger_up(const rb_tree * tree, rb_node * node, const char * key) {
+    uint64_t prefix = rb_prefix(tree, key);
+    int side = rb_cmp_node(tree, key, prefix, node);
+
+    if (side == 0) {
+        return node;
+    }
+
+    for (;;) {
+        rb_node * t = node;
+
+        while (rb_parent(t) != NULL && t == (side > 0 ? rb_parent(t)->right : rb_parent(t)->left)) {
+            t = rb_parent(t);
+        }
+
+        if (rb_parent(t) == NULL) {
+            return node;
+        }
+
+        int cmp = rb_cmp_node(tree, key, prefix, rb_parent(t));
+
+        if (cmp == 0) {
+            return rb_parent(t);
+        } else if ((cmp < 0) == (side > 0)) {
+            return node;
+        }
+
+        node = rb_parent(t);
+    }
+}
+
+/**
+ * @brief Get the node to start a search from
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param hint Pointer to a hint, or NULL.
+ * @param key Data key.
+ * @return Ancestor of the hinted node that covers key, or the root if the
+ *         hint is empty or stale.
+ */
+
+static rb_node * rb_start(const rb_tree * tree, const rb_hint * hint, const char * key) {
+    if (hint == NULL || hint->node == NULL || hint->epoch != tree->epoch) {
+        return tree->root;
+    }
+
+    return rb_finger_up(tree, hint->node, key);
+}
+
+/**
+ * @brief Record an accessed node in a hint
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param hint Pointer to a hint, or NULL.
+ * @param node Pointer to the accessed node, or NULL to keep the hint.
+ */
+
+static void rb_remember(const rb_tree * tree, rb_hint * hint, rb_node * node) {
+    if (hint != NULL && node != NULL) {
+        hint->node = node;
+        hint->epoch = tree->epoch;
+    }
+}
+
+/**
+ * @brief Get the finger of a tree
+ *
+ * Lookups only hold a read lock, so concurrent trees do not use the finger.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @return Pointer to the finger, or NULL.
+ */
+
+static rb_hint * rb_finger(const rb_tree * tree) {
+    return tree->lock ? NULL : tree->finger;
+}
+
+/**
+ * @brief Find the lowest key not lower than a key, starting from a finger
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to the finger node.
+ * @param key Data key, greater than or equal to the finger's key.
+ * @return Pointer to the first node whose key is greater than or equal to key.
+ * @retval NULL All keys in the tree are lower than key.
+ */
+
+static rb_node * rb_finger_seek(const rb_tree * tree, rb_node * node, const char * key) {
+    rb_node * start = rb_finger_up(tree, node, key);
+    rb_node * bound = rb_lower_bound(tree, start, key);
+
+    if (bound != NULL) {
+        return bound;
+    }
+
+    // Not in the subtree: the bound is the ancestor that holds it on its left side
+    while (rb_parent(start) != NULL && start == rb_parent(start)->right) {
+        start = rb_parent(start);
+    }
+
+    return rb_parent(start);
+}
+
+/**
+ * @brief Get the black height of a subtree
+ *
+ * @param node Pointer to the root of the subtree, or NULL.
+ * @return Number of black nodes from node (included) down to any leaf.
+ */
+
+static unsigned rb_black_height(const rb_node * node) {
+    unsigned height = 0;
+
+    for (; node != NULL; node = node->left) {
+        height += rb_node_color(node) == RB_BLACK;
+    }
+
+    return height;
+}
+
+/**
+ * @brief Join two subtrees with a middle node
+ *
+ * The shorter subtree replaces the black node of the same black height on
+ * the inner spine of the taller one, under the middle node, that is red.
+ * Then the tree is rebalanced as after an insertion, so the cost is
+ * proportional to the difference of black heights.
+ *
+ * @param tree Pointer to a red-black tree, whose root is set to the result.
+ * @param left Root of the subtree with the lower keys, or NULL. Its parent
+ *             must be NULL.
+ * @param lh Black height of left.
+ * @param node Pointer to a detached node, with keys between both subtrees.
+ * @param right Root of the subtree with the greater keys, or NULL. Its parent
+ *              must be NULL.
+ * @param rh Black height of right.
+ * @return Black height of the result.
+ * @post In builds with RBTREE_STATS, the path length grows by the depths that
+ *       node and right (if left is taller) or left (otherwise) take, but not
+ *       by their path length as a separate tree.
+ */
+
+static unsigned rb_join(rb_tree * tree, rb_node * left, unsigned lh, rb_node * node, rb_node * right, unsigned rh) {
+    // A red root can be made black, adding one to its black height
+    if (left != NULL && rb_node_color(left) == RB_RED) {
+        rb_set_color(left, RB_BLACK);
+        lh++;
+    }
+
+    if (right != NULL && rb_node_color(right) == RB_RED) {
+        rb_set_color(right, RB_BLACK);
+        rh++;
+    }
+
+    unsigned height = lh >= rh ? lh : rh;
+    rb_node * parent = NULL;
+    rb_node * child = lh >= rh ? left : right;
+    rb_node * other = lh >= rh ? right : left;
+    uint64_t depth = 0;
+
+    while (child != NULL && (rb_node_color(child) == RB_RED || height != (lh >= rh ? rh : lh))) {
+        height -= rb_node_color(child) == RB_BLACK;
+        parent = child;
+        child = lh >= rh ? child->right : child->left;
+        depth++;
+    }
+
+    if (lh >= rh) {
+        node->left = child;
+        node->right = right;
+    } else {
+        node->left = left;
+        node->right = child;
+    }
+
+    if (parent == NULL) {
+        tree->root = node;
+    } else {
+        tree->root = lh >= rh ? left : right;
+
+        if (lh >= rh) {
+            parent->right = node;
+        } else {
+            parent->left = node;
+        }
+    }
+
+    if (child != NULL) {
+        rb_set_parent(child, node);
+    }
+
+    if (other != NULL) {
+        rb_set_parent(other, node);
+    }
+
+    node->parent_color = (uintptr_t)parent | RB_RED;
+    node->size = rb_size(node->left) + 1 + rb_size(node->right);
+
+    // child goes one level down, and node and other hang where it was
+    RB_STAT(tree, path_length, rb_size(child) + depth + (depth + 1) * rb_size(other));
+
+    for (rb_node * p = parent; p != NULL; p = rb_parent(p)) {
+        p->size += rb_size(other) + 1;
+    }
+
+    return (lh >= rh ? lh : rh) + rb_balance_insert(tree, node);
+}
+
+/**
+ * @brief Split a subtree by a key
+ *
+ * The search path is cut, and the subtrees that hang from it are joined
+ * bottom-up into both halves. The black heights of consecutive joins
+ * telescope, so the total cost is logarithmic.
+ *
+ * @param tree Pointer to a red-black tree, whose root is used as scratch.
+ * @param node Root of the subtree, or NULL. Its parent must be NULL.
+ * @param height Black height of node.
+ * @param key Split key.
+ * @param prefix Cached prefix of key.
+ * @param inclusive Put key itself into left (1) or right (0).
+ * @param[out] left Root of the subtree with the keys lower than key.
+ * @param[out] lh Black height of left.
+ * @param[out] right Root of the subtree with the keys greater than key.
+ * @param[out] rh Black height of right.
+ */
+
+static void rb_split(rb_tree * tree, rb_node * node, unsigned height, const char * key, uint64_t prefix, int inclusive, rb_node ** left, unsigned * lh, rb_node ** right, unsigned * rh) {
+    if (node == NULL) {
+        *left = *right = NULL;
+        *lh = *rh = 0;
+        return;
+    }
+
+    rb_node * l = node->left;
+    rb_node * r = node->right;
+    height -= rb_node_color(node) == RB_BLACK;
+
+    if (l != NULL) {
+        rb_set_parent(l, NULL);
+    }
+
+    if (r != NULL) {
+        rb_set_parent(r, NULL);
+    }
+
+    int cmp = rb_cmp_node(tree, key, prefix, node);
+
+    if (cmp < 0 || (cmp == 0 && !inclusive)) {
+        rb_split(tree, l, height, key, prefix, inclusive, left, lh, right, rh);
+        *rh = rb_join(tree, *right, *rh, node, r, height);
+        *right = tree->root;
+    } else {
+        rb_split(tree, r, height, key, prefix, inclusive, left, lh, right, rh);
+        *lh = rb_join(tree, l, height, node, *left, *lh);
+        *left = tree->root;
+    }
+}
+
+/**
+ * @brief Compute the path length of a tree, and the bytes held by its nodes
+ *
+ * The tree is walked through the parent pointers, without recursion.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param[out] bytes Set to the bytes held by the nodes, if not NULL.
+ * @return Sum of the depths of all nodes, with the root at 0.
+ */
+
+static uint64_t rb_path_length(const rb_tree * tree, uint64_t * bytes) {
+    const rb_node * prev = NULL;
+    const rb_node * node = tree->root;
+    uint64_t depth = 0;
+    uint64_t path_length = 0;
+    uint64_t total = 0;
+
+    while (node != NULL) {
+        const rb_node * parent = rb_parent(node);
+        const rb_node * next;
+
+        if (prev == parent) {
+            path_length += depth++;
+            total += rb_node_size(rb_key_size(tree, node->key));
+            next = node->left ? node->left : node->right ? node->right : parent;
+        } else if (prev == node->left && node->right != NULL) {
+            next = node->right;
+        } else {
+            next = parent;
+        }
+
+        if (next == parent) {
+            depth--;
+        }
+
+        prev = node;
+        node = next;
+    }
+
+    if (bytes != NULL) {
+        *bytes = total;
+    }
+
+    return path_length;
+}
+
+#ifdef RBTREE_STATS
+
+/**
+ * @brief Recompute the path length and the node bytes of a tree
+ *
+ * @param tree Pointer to a red-black tree.
+ */
+
+static void rb_restat(rb_tree * tree) {
+    tree->stats->path_length = rb_path_length(tree, &tree->stats->bytes);
+}
+
+#endif
+
+/**
+ * @brief Delete all the keys in a range
+ *
+ * The tree is split before min and after max, the middle part is freed, and
+ * the outer parts are joined back, so the cost is O(log n) plus the number
+ * of deleted nodes.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param min Lowest key of the range (included).
+ * @param max Highest key of the range (included).
+ * @post The values are disposed if a dispose function was defined.
+ */
+
+static void rb_delete_range(rb_tree * tree, const char * min, const char * max) {
+    rb_node * root = tree->root;
+    rb_node * low;
+    rb_node * rest;
+    rb_node * band;
+    rb_node * high;
+    unsigned lh;
+    unsigned rh;
+    unsigned bh;
+    unsigned hh;
+
+    rb_split(tree, root, rb_black_height(root), min, rb_prefix(tree, min), 0, &low, &lh, &rest, &rh);
+    rb_split(tree, rest, rh, max, rb_prefix(tree, max), 1, &band, &bh, &high, &hh);
+
+#ifdef RBTREE_THREADED
+    rb_node * before = rb_min(band)->prev;
+    rb_node * after = rb_max(band)->next;
+
+    if (before != NULL) {
+        before->next = after;
+    }
+
+    if (after != NULL) {
+        after->prev = before;
+    }
+#endif
+
+    // Pooled trees recycle the nodes too, as deleted nodes are not reused otherwise
+    tree->root = band;
+    rb_destroy(tree, UINT_MAX, 1);
+
+    if (high != NULL) {
+        // The minimum of the upper part becomes the middle node
+        rb_node * node = rb_min(high);
+        tree->root = high;
+        rb_unlink(tree, node);
+        high = tree->root;
+        rb_join(tree, low, lh, node, high, rb_black_height(high));
+#ifdef RBTREE_THREADED
+        rb_relink(node);
+#endif
+    } else {
+        tree->root = low;
+
+        if (low != NULL) {
+            rb_set_color(low, RB_BLACK);
+        }
+    }
+
+    rb_ends(tree);
+
+#ifdef RBTREE_STATS
+    rb_restat(tree);
+#endif
+}
+
+/**
+ * @brief Unlink an extreme node and free it
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param node Pointer to the leftmost or rightmost node of the tree.
+ * @param[out] value Set to the value of the node, if not NULL.
+ * @return Copy of the key, to be freed with free().
+ * @post The value is not disposed.
+ */
+
+static char * rb_pop(rb_tree * tree, rb_node * node, void ** value) {
+    size_t size = rb_key_size(tree, node->key);
+    char * key = memcpy(malloc(size), node->key, size);
+
+    if (value != NULL) {
+        *value = node->value;
+    }
+
+    rb_snap_keep(tree, node);
+    rb_unlink(tree, node);
+    rb_free(tree, node);
+    return key;
+}
+
+/// Element of a batch of key-values
+typedef struct rb_entry {
+    const rb_tree * tree;       ///< Tree that defines the key order
+    const char * key;           ///< Data key
+    void * value;               ///< Data value
+    unsigned index;             ///< Position in the input, to keep sorting stable
+} rb_entry;
+
+/**
+ * @brief Compare two batch entries by key, then by position
+ *
+ * @param a Pointer to the first entry.
+ * @param b Pointer to the second entry.
+ * @return Negative, zero or positive, as rb_cmp does.
+ */
+
+static int rb_entry_cmp(const void * a, const void * b) {
+    const rb_entry * ea = a;
+    const rb_entry * eb = b;
+    int cmp = rb_cmp(ea->tree, ea->key, eb->key);
+    return cmp != 0 ? cmp : (ea->index > eb->index) - (ea->index < eb->index);
+}
+
+/**
+ * @brief Fill an empty pooled tree from a sorted array
+ *
+ * @param tree Pointer to an empty tree created by rbtree_init_pooled.
+ * @param keys Array of n keys, in strictly increasing order.
+ * @param values Array of n values, or NULL.
+ * @param n Number of elements.
+ */
+
+static void rb_build_tree(rb_tree * tree, char * const * keys, void * const * values, unsigned n) {
+    size_t total = 0;
+    unsigned red_depth = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        total += rb_pool_round(rb_node_size(rb_key_size(tree, keys[i])));
+    }
+
+    // Levels 0 .. red_depth - 1 are complete
+    while (red_depth < 32 && (1ULL << (red_depth + 1)) - 1 <= n) {
+        red_depth++;
+    }
+
+    rb_pool_reserve(tree->allocator.context, total);
+    tree->root = rb_build(tree, keys, values, 0, n, 0, red_depth, NULL);
+    rb_ends(tree);
+#ifdef RBTREE_THREADED
+    rb_thread(tree);
+#endif
+}
+
+/**
+ * @brief Get the height of a tree
+ *
+ * The tree is walked through the parent pointers, without recursion.
+ *
+ * @param root Pointer to the root node, or NULL.
+ * @return Number of nodes in the longest path down from root.
+ */
+
+static unsigned rb_height(const rb_node * root) {
+    const rb_node * prev = NULL;
+    const rb_node * node = root;
+    unsigned height = 0;
+    unsigned depth = 0;
+
+    while (node != NULL) {
+        const rb_node * parent = rb_parent(node);
+        const rb_node * next;
+
+        if (prev == parent) {
+            if (++depth > height) {
+                height = depth;
+            }
+
+            next = node->left ? node->left : node->right ? node->right : parent;
+        } else if (prev == node->left && node->right != NULL) {
+            next = node->right;
+        } else {
+            next = parent;
+        }
+
+        if (next == parent) {
+            depth--;
+        }
+
+        prev = node;
+        node = next;
+    }
+
+    return height;
+}
+
+static void rb_veb(rb_node * node, unsigned height, rb_node ** order, unsigned * count);
+
+/**
+ * @brief Lay out the subtrees hanging at a given depth below a node
+ *
+ * @param node Pointer to a red-black tree node.
+ * @param depth Depth of the subtrees, relative to node.
+ * @param height Number of levels of each subtree to lay out.
+ * @param order Array of nodes in layout order.
+ * @param count Number of nodes in order.
+ */
+
+static void rb_veb_below(rb_node * node, unsigned depth, unsigned height, rb_node ** order, unsigned * count) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (depth == 0) {
+        rb_veb(node, height, order, count);
+    } else {
+        rb_veb_below(node->left, depth - 1, height, order, count);
+        rb_veb_below(node->right, depth - 1, height, order, count);
+    }
+}
+
+/**
+ * @brief Lay out the top levels of a subtree in van Emde Boas order
+ *
+ * The top half of the levels is laid out first, and then every subtree
+ * hanging below it, each one recursively in the same order. So every
+ * subtree of about 2^k levels ends up in a contiguous span, whatever the
+ * cache line size.
+ *
+ * @param node Pointer to a red-black tree node.
+ * @param height Number of levels to lay out.
+ * @param order Array of nodes in layout order.
+ * @param count Number of nodes in order.
+ */
+
+static void rb_veb(rb_node * node, unsigned height, rb_node ** order, unsigned * count) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (height == 1) {
+        order[(*count)++] = node;
+        return;
+    }
+
+    unsigned top = height / 2;
+    rb_veb(node, top, order, count);
+    rb_veb_below(node, top, height - top, order, count);
+}
+
+/**
+ * @brief Copy all the nodes of a tree into blocks of an allocator
+ *
+ * Nodes are copied in the given order, and each old node temporarily holds
+ * the address of its copy in its value field, to translate the links. The
+ * tree is left pointing to the copies, and the old nodes are freed with the
+ * tree allocator, unless it has a release function. The caller sets the new
+ * allocator.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param order Array with all the nodes of the tree.
+ * @param n Number of nodes.
+ * @param allocator Allocator for the copies.
+ */
+
+static void rb_copy(rb_tree * tree, rb_node ** order, unsigned n, const rb_allocator * allocator) {
+    for (unsigned i = 0; i < n; i++) {
+        size_t size = rb_node_size(rb_key_size(tree, order[i]->key));
+        rb_node * copy = allocator->alloc(allocator->context, size);
+
+        memcpy(copy, order[i], size);
+        order[i]->value = copy;
+    }
+
+    for (unsigned i = 0; i < n; i++) {
+        rb_node * copy = order[i]->value;
+
+        rb_set_parent(copy, rb_parent(copy) ? rb_parent(copy)->value : NULL);
+        copy->left = copy->left ? copy->left->value : NULL;
+        copy->right = copy->right ? copy->right->value : NULL;
+#ifdef RBTREE_THREADED
+        copy->next = copy->next ? copy->next->value : NULL;
+        copy->prev = copy->prev ? copy->prev->value : NULL;
+#endif
+    }
+
+    if (tree->root != NULL) {
+        tree->root = tree->root->value;
+        tree->first = tree->first->value;
+        tree->last = tree->last->value;
+    }
+
+    // Nodes were moved, not freed, so they are not counted in the statistics
+    if (tree->allocator.release == NULL) {
+        for (unsigned i = 0; i < n; i++) {
+            tree->allocator.free(tree->allocator.context, order[i], rb_node_size(rb_key_size(tree, order[i]->key)));
+        }
+    }
+}
+
+/**
+ * @brief Move all the nodes of a tree into a new pool, in van Emde Boas order
+ *
+ * Nodes are copied in layout order into a single contiguous chunk. The old
+ * nodes are then freed, and the tree takes the new pool as its allocator.
+ *
+ * @param tree Pointer to a red-black tree.
+ */
+
+static void rb_relayout(rb_tree * tree) {
+    unsigned n = rb_size(tree->root);
+    unsigned count = 0;
+    size_t total = 0;
+    rb_allocator pool = { rb_pool_alloc, rb_pool_free, rb_pool_release, rb_pool_create() };
+    rb_node ** order = malloc(sizeof(rb_node *) * (n ? n : 1));
+
+    rb_veb(tree->root, rb_height(tree->root), order, &count);
+
+    for (unsigned i = 0; i < n; i++) {
+        total += rb_pool_round(rb_node_size(rb_key_size(tree, order[i]->key)));
+    }
+
+    rb_pool_reserve(pool.context, total);
+    rb_copy(tree, order, n, &pool);
+
+    if (tree->allocator.release != NULL) {
+        tree->allocator.release(tree->allocator.context);
+    }
+
+    tree->allocator = pool;
+    tree->epoch++;
+    free(order);
+}
+
+/**
+ * @brief Move all the nodes of a tree into blocks of another allocator
+ *
+ * Nodes are copied in key order, which takes linear time. The tree keeps its
+ * allocator, so that the caller can release it.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param allocator Allocator for the copies.
+ */
+
+static void rb_move(rb_tree * tree, const rb_allocator * allocator) {
+    unsigned n = rb_size(tree->root);
+    unsigned count = 0;
+    rb_node ** order = malloc(sizeof(rb_node *) * (n ? n : 1));
+
+    for (rb_node * node = tree->first; node != NULL; node = rb_next(node)) {
+        order[count++] = node;
+    }
+
+    rb_copy(tree, order, n, allocator);
+    tree->epoch++;
+    free(order);
+}
+
+/**
+ * @brief Check whether two allocators are the same one
+ *
+ * @param a Pointer to an allocator.
+ * @param b Pointer to an allocator.
+ * @return 1 if both allocate and free with the same functions and context.
+ */
+
+static int rb_same_allocator(const rb_allocator * a, const rb_allocator * b) {
+    return a->alloc == b->alloc && a->free == b->free && a->release == b->release && a->context == b->context;
+}
+
+#define RB_IMAGE_MAGIC "RBTREE2"  // Image file signature, with its null byte
+
+#define rb_image_align(offset) (((offset) + 7) & ~(uint64_t)7)
+
+/// Header of an image file
+typedef struct rb_image_header {
+    char magic[8];              ///< RB_IMAGE_MAGIC
+    uint32_t key_type;          ///< Key type
+    uint32_t count;             ///< Number of elements
+    uint64_t key_size;          ///< Key size for fixed-size keys, or 0 for strings
+    uint64_t length;            ///< Size of the whole image, in bytes
+} rb_image_header;
+
+/// Element of an image file. Offsets are relative to the file start.
+typedef struct rb_image_entry {
+    uint64_t key;               ///< Key offset
+    uint64_t value;             ///< Value offset, or 0 for a NULL value
+    uint64_t value_size;        ///< Value size
+} rb_image_entry;
+
+/// Image file mapped in memory
+struct rb_image {
+    char * base;                    ///< Mapping address
+    size_t length;                  ///< Mapping length
+    unsigned count;                 ///< Number of elements
+    const rb_image_entry * entries; ///< Elements, in key order
+};
+
+/**
+ * @brief Check the key type of an image header
+ *
+ * @param header Pointer to an image header.
+ * @return 1 if the type is known and its key size matches, or 0.
+ */
+
+static int rb_image_key_type(const rb_image_header * header) {
+    switch (header->key_type) {
+    case RB_KEY_STRING:
+    case RB_KEY_CUSTOM:
+        return header->key_size == 0;
+
+    case RB_KEY_U64:
+        return header->key_size == sizeof(uint64_t);
+
+    case RB_KEY_BINARY:
+        return header->key_size > 0;
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Check that the entries of an image point inside it
+ *
+ * Offsets must fall past the entries and within the image, and string keys
+ * must be terminated before its end.
+ *
+ * @param base Pointer to the image start, with a valid header.
+ * @return 1 if all the keys and values are inside the image, or 0.
+ */
+
+static int rb_image_entries(const char * base) {
+    const rb_image_header * header = (const rb_image_header *)base;
+    const rb_image_entry * entries = (const rb_image_entry *)(header + 1);
+    uint64_t start = sizeof(rb_image_header) + sizeof(rb_image_entry) * (uint64_t)header->count;
+    uint64_t length = header->length;
+
+    for (unsigned i = 0; i < header->count; i++) {
+        const rb_image_entry * entry = entries + i;
+
+        if (entry->key < start || entry->key >= length) {
+            return 0;
+        }
+
+        if (header->key_size ? header->key_size > length - entry->key : memchr(base + entry->key, '\0', length - entry->key) == NULL) {
+            return 0;
+        }
+
+        if (entry->value != 0 && (entry->value < start || entry->value > length || entry->value_size > length - entry->value)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Get the key of an image element
+ *
+ * @param image Pointer to a mapped image.
+ * @param index Element position.
+ * @return Pointer to the key, inside the mapping.
+ */
+
+static const char * rb_image_key(const rb_image * image, unsigned index) {
+    return image->base + image->entries[index].key;
+}
+
+/**
+ * @brief Get the value of an image element
+ *
+ * @param image Pointer to a mapped image.
+ * @param index Element position.
+ * @return Pointer to the value, inside the mapping, or NULL.
+ */
+
+static void * rb_image_value(const rb_image * image, unsigned index) {
+    return image->entries[index].value ? image->base + image->entries[index].value : NULL;
+}
+
+/**
+ * @brief Count the image keys that precede a key
+ *
+ * @param tree Pointer to a tree with a mapped image.
+ * @param key Data key.
+ * @param inclusive If nonzero, also count a key equal to key.
+ * @return Number of keys lower than key (or lower or equal, if inclusive).
+ */
+
+static unsigned rb_image_rank(const rb_tree * tree, const char * key, int inclusive) {
+    unsigned lo = 0;
+    unsigned hi = tree->image->count;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        int cmp = rb_cmp(tree, key, rb_image_key(tree->image, mid));
+
+        if (cmp < 0 || (cmp == 0 && !inclusive)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * @brief Find a key in an image
+ *
+ * @param tree Pointer to a tree with a mapped image.
+ * @param key Data key.
+ * @return Position of the key.
+ * @retval count Key not found.
+ */
+
+static unsigned rb_image_find(const rb_tree * tree, const char * key) {
+    unsigned index = rb_image_rank(tree, key, 0);
+
+    if (index < tree->image->count && rb_cmp(tree, key, rb_image_key(tree->image, index)) != 0) {
+        index = tree->image->count;
+    }
+
+    return index;
+}
+
+/**
+ * @brief Copy the keys of a sequence of image elements
+ *
+ * @param tree Pointer to a tree with a mapped image.
+ * @param first Position of the first element.
+ * @param count Number of elements to copy.
+ * @return Newly allocated null-terminated array of keys.
+ */
+
+static char ** rb_image_keys(const rb_tree * tree, unsigned first, unsigned count) {
+    char ** array = malloc(sizeof(char *) * (count + 1));
+
+    for (unsigned i = 0; i < count; i++) {
+        const char * key = rb_image_key(tree->image, first + i);
+        size_t size = rb_key_size(tree, key);
+        array[i] = memcpy(malloc(size), key, size);
+    }
+
+    array[count] = NULL;
+    return array;
+}
+
+/**
+ * @brief Get the number of elements of a tree
+ *
+ * @param tree Pointer to a red-black tree.
+ * @return Number of nodes, or of image elements.
+ */
+
+static unsigned rb_count(const rb_tree * tree) {
+    return tree->image ? tree->image->count : rb_size(tree->root);
+}
+
+/**
+ * @brief Get all the elements of a tree, in key order
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param[out] keys Array of rb_count(tree) keys, owned by the tree.
+ * @param[out] values Array of rb_count(tree) values.
+ */
+
+static void rb_elements(const rb_tree * tree, const char ** keys, void ** values) {
+    unsigned n = rb_count(tree);
+
+    if (tree->image != NULL) {
+        for (unsigned i = 0; i < n; i++) {
+            keys[i] = rb_image_key(tree->image, i);
+            values[i] = rb_image_value(tree->image, i);
+        }
+    } else {
+        rb_node * node = tree->root ? rb_min(tree->root) : NULL;
+
+        for (unsigned i = 0; i < n; i++, node = rb_next(node)) {
+            keys[i] = node->key;
+            values[i] = node->value;
+        }
+    }
+}
+
+/**
+ * @brief Get the black depth of the tree that an image would be built into
+ *
+ * @param image Pointer to a mapped image.
+ * @return Black depth, as rbtree_black_depth returns it.
+ */
+
+static int rb_image_black_depth(const rb_image * image) {
+    int depth = 0;
+
+    // rb_build makes all the levels above the red one complete and black
+    while ((1ULL << (depth + 1)) - 1 <= image->count) {
+        depth++;
+    }
+
+    return depth;
+}
+
+/**
+ * @brief Get the path length of the tree that an image would be built into
+ *
+ * rb_build splits a run of m keys into runs of m / 2 and (m - 1) / 2, so the
+ * subtrees at each level have one of two consecutive sizes. Counting them per
+ * level takes O(log n).
+ *
+ * @param image Pointer to a mapped image.
+ * @return Sum of the depths of all nodes, with the root at 0.
+ */
+
+static uint64_t rb_image_path_length(const rb_image * image) {
+    uint64_t path_length = 0;
+    uint64_t size = image->count;
+    uint64_t count[2] = { 1, 0 };   // Subtrees of size and size + 1 keys
+
+    for (uint64_t depth = 0; (size > 0 && count[0] > 0) || count[1] > 0; depth++) {
+        uint64_t base = size > 0 ? (size - 1) / 2 : 0;
+        uint64_t next[2] = { 0, 0 };
+
+        if (size > 0) {
+            path_length += depth * count[0];
+            next[size / 2 - base] += count[0];
+            next[(size - 1) / 2 - base] += count[0];
+        }
+
+        path_length += depth * count[1];
+        next[(size + 1) / 2 - base] += count[1];
+        next[size / 2 - base] += count[1];
+
+        size = base;
+        count[0] = next[0];
+        count[1] = next[1];
+    }
+
+    return path_length;
+}
+
+
+/**
+ * @brief Unmap an image
+ *
+ * @param image Pointer to a mapped image.
+ */
+
+static void rb_image_close(rb_image * image) {
+    munmap(image->base, image->length);
+    free(image);
+}
+
+/**
+ * @brief Turn an image-backed tree into a regular tree
+ *
+ * The nodes are built from the image in linear time, values are copied into
+ * blocks allocated with malloc, and then the image is unmapped. This is a
+ * no-op if the tree has no image.
+ *
+ * @param tree Pointer to a pooled red-black tree.
+ */
+
+static void rb_promote(rb_tree * tree) {
+    rb_image * image = tree->image;
+
+    if (image == NULL) {
+        return;
+    }
+
+    unsigned n = image->count;
+    const char ** keys = malloc(sizeof(char *) * (n ? n : 1));
+    void ** values = malloc(sizeof(void *) * (n ? n : 1));
+
+    rb_elements(tree, keys, values);
+
+    for (unsigned i = 0; i < n; i++) {
+        if (values[i] != NULL) {
+            size_t size = image->entries[i].value_size;
+            values[i] = memcpy(malloc(size ? size : 1), values[i], size);
+        }
+    }
+
+    rb_build_tree(tree, (char * const *)keys, values, n);
+    tree->image = NULL;
+    rb_image_close(image);
+
+    free(keys);
+    free(values);
+}
+
+/**
+ * @brief Write the elements of a tree to an image file
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param file Output stream.
+ * @param value_size Pointer to a function to get the size of a value, or NULL.
+ * @retval 0 Success.
+ * @retval -1 Write error.
+ */
+
+static int rb_save(const rb_tree * tree, FILE * file, size_t (*value_size)(const void *)) {
+    static const char zeros[8];
+    unsigned n = rb_count(tree);
+    const char ** keys = malloc(sizeof(char *) * (n ? n : 1));
+    void ** values = malloc(sizeof(void *) * (n ? n : 1));
+    rb_image_entry * entries = malloc(sizeof(rb_image_entry) * (n ? n : 1));
+    rb_image_header header = { RB_IMAGE_MAGIC, tree->key_type, n, tree->key_size, 0 };
+    uint64_t offset = sizeof(header) + sizeof(rb_image_entry) * n;
+    int error = 0;
+
+    rb_elements(tree, keys, values);
+
+    // Fixed-size keys and values are 8-byte aligned
+    for (unsigned i = 0; i < n; i++) {
+        offset = tree->key_size ? rb_image_align(offset) : offset;
+        entries[i].key = offset;
+        offset += rb_key_size(tree, keys[i]);
+
+        if (values[i] != NULL && value_size != NULL) {
+            offset = rb_image_align(offset);
+            entries[i].value = offset;
+            entries[i].value_size = value_size(values[i]);
+            offset += entries[i].value_size;
+        } else {
+            entries[i].value = 0;
+            entries[i].value_size = 0;
+        }
+    }
+
+    header.length = offset;
+    error |= fwrite(&header, sizeof(header), 1, file) != 1;
+    error |= n > 0 && fwrite(entries, sizeof(rb_image_entry), n, file) != n;
+    offset = sizeof(header) + sizeof(rb_image_entry) * n;
+
+    for (unsigned i = 0; i < n && !error; i++) {
+        error |= fwrite(zeros, 1, entries[i].key - offset, file) != entries[i].key - offset;
+        offset = entries[i].key + rb_key_size(tree, keys[i]);
+        error |= fwrite(keys[i], 1, offset - entries[i].key, file) != offset - entries[i].key;
+
+        if (entries[i].value != 0) {
+            error |= fwrite(zeros, 1, entries[i].value - offset, file) != entries[i].value - offset;
+            offset = entries[i].value + entries[i].value_size;
+            error |= fwrite(values[i], 1, entries[i].value_size, file) != entries[i].value_size;
+        }
+    }
+
+    free(keys);
+    free(values);
+    free(entries);
+    return error ? -1 : 0;
+}
+
+#define RB_TASKS_PER_THREAD 8    // Tasks per thread in parallel scans, to balance uneven work
+
+/// Run of consecutive elements, scanned by a single thread
+typedef struct rb_task {
+    rb_node * first;            ///< First node, or NULL for image trees
+    unsigned index;             ///< Position of the first element
+    unsigned count;             ///< Number of elements
+    void * acc;                 ///< Accumulated result of a map-reduce
+} rb_task;
+
+/// Parallel scan shared by all threads
+typedef struct rb_job {
+    const rb_tree * tree;       ///< Tree to scan
+    rb_task * tasks;            ///< Tasks, in key order
+    unsigned ntasks;            ///< Number of tasks
+    unsigned next;              ///< Next task to run, taken atomically
+    int (*fn)(const char *, void *, void *);            ///< Visitor, for rbtree_foreach_parallel
+    void * (*map)(const char *, void *, void *, void *); ///< Map function, for rbtree_map_reduce
+    void * ctx;                 ///< Opaque pointer for fn and map
+    int result;                 ///< First nonzero value returned by fn
+} rb_job;
+
+/**
+ * @brief Run tasks of a parallel scan until there are none left
+ *
+ * Threads take the next pending task from a shared counter, so a thread that
+ * finishes early keeps taking work from the slower ones.
+ *
+ * @param arg Pointer to the job.
+ * @return NULL.
+ */
+
+static void * rb_worker(void * arg) {
+    rb_job * job = arg;
+    const rb_image * image = job->tree->image;
+    unsigned i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->ntasks) {
+        rb_task * task = job->tasks + i;
+        rb_node * node = task->first;
+
+        for (unsigned j = 0; j < task->count; j++) {
+            const char * key = image ? rb_image_key(image, task->index + j) : node->key;
+            void * value = image ? rb_image_value(image, task->index + j) : node->value;
+
+            if (job->map != NULL) {
+                task->acc = job->map(key, value, task->acc, job->ctx);
+            } else if (__atomic_load_n(&job->result, __ATOMIC_RELAXED) != 0) {
+                return NULL;
+            } else {
+                int r = job->fn(key, value, job->ctx);
+
+                if (r != 0) {
+                    int expected = 0;
+                    __atomic_compare_exchange_n(&job->result, &expected, r, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                    return NULL;
+                }
+            }
+
+            node = node ? rb_next(node) : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Scan a tree with a number of threads
+ *
+ * The elements are split into runs of about the same size, and the first
+ * node of each run is found by position, in O(log n). The calling thread is
+ * one of the workers, so if threads cannot be created, the tasks are still
+ * done by those that started.
+ *
+ * @param job Pointer to a job with the tree and the functions set.
+ * @param nthreads Number of threads, or 0 to use all online processors.
+ * @post job->tasks holds the tasks, in key order. The caller must free it.
+ */
+
+static void rb_parallel(rb_job * job, unsigned nthreads) {
+    unsigned n = rb_count(job->tree);
+
+    if (nthreads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cores > 0 ? cores : 1;
+    }
+
+    if (nthreads > UINT_MAX / RB_TASKS_PER_THREAD) {
+        nthreads = UINT_MAX / RB_TASKS_PER_THREAD;
+    }
+
+    job->ntasks = n < nthreads * RB_TASKS_PER_THREAD ? n : nthreads * RB_TASKS_PER_THREAD;
+    job->tasks = malloc(sizeof(rb_task) * (job->ntasks ? job->ntasks : 1));
+    job->next = 0;
+    job->result = 0;
+
+    for (unsigned i = 0; i < job->ntasks; i++) {
+        rb_task * task = job->tasks + i;
+        task->index = (uint64_t)n * i / job->ntasks;
+        task->count = (uint64_t)n * (i + 1) / job->ntasks - task->index;
+        task->first = job->tree->image ? NULL : rb_select(job->tree, task->index);
+        task->acc = NULL;
+    }
+
+    if (nthreads > job->ntasks) {
+        nthreads = job->ntasks ? job->ntasks : 1;
+    }
+
+    pthread_t * threads = malloc(sizeof(pthread_t) * nthreads);
+    unsigned started = 1;
+
+    if (threads != NULL) {
+        while (started < nthreads && pthread_create(threads + started, NULL, rb_worker, job) == 0) {
+            started++;
+        }
+    }
+
+    rb_worker(job);
+
+    for (unsigned i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+/**
+ * @brief Fold a tree with a number of threads
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param map Pointer to a function that adds an element to an accumulator.
+ * @param reduce Pointer to a function that combines two accumulators.
+ * @param ctx Opaque pointer that is passed to map and reduce.
+ * @param nthreads Number of threads, or 0 to use all online processors.
+ * @return Accumulator of the whole tree, or NULL if it is empty.
+ */
+
+static void * rb_map_reduce(const rb_tree * tree, void * (*map)(const char *, void *, void *, void *), void * (*reduce)(void *, void *, void *), void * ctx, unsigned nthreads) {
+    rb_job job = { .tree = tree, .map = map, .ctx = ctx };
+    void * acc = NULL;
+
+    rb_parallel(&job, nthreads);
+
+    for (unsigned i = 0; i < job.ntasks; i++) {
+        acc = i == 0 ? job.tasks[i].acc : reduce(acc, job.tasks[i].acc, ctx);
+    }
+
+    free(job.tasks);
+    return acc;
+}
+
+/**
+ * @brief Move an iterator forward to the lowest key not lower than a key
+ *
+ * Node trees are searched from the current node (see rb_finger_seek), and
+ * images with an exponential search from the current position, so the cost
+ * is logarithmic in the distance moved.
+ *
+ * @param tree Pointer to the tree of the iterator.
+ * @param iter Pointer to an iterator, at a key not greater than key, or past
+ *             the end.
+ * @param key Data key.
+ */
+
+static void rb_iter_advance(const rb_tree * tree, rb_iter * iter, const char * key) {
+    const char * current = rbtree_iter_key(iter);
+
+    if (current == NULL || rb_cmp(tree, current, key) >= 0) {
+        return;
+    }
+
+    if (iter->image == NULL) {
+        iter->node = rb_finger_seek(tree, iter->node, key);
+        return;
+    }
+
+    unsigned count = iter->image->count;
+    unsigned lo = iter->index + 1;
+    unsigned step = 1;
+
+    while (lo + step <= count && rb_cmp(tree, rb_image_key(iter->image, lo + step - 1), key) < 0) {
+        lo += step;
+        step *= 2;
+    }
+
+    unsigned hi = lo + step <= count ? lo + step - 1 : count;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (rb_cmp(tree, rb_image_key(iter->image, mid), key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    iter->index = lo;
+}
+
+/// Sorted sequence of key-values
+typedef struct rb_output {
+    const char ** keys;         ///< Keys, owned by the source trees
+    void ** values;             ///< Values
+    unsigned count;             ///< Number of elements
+    unsigned capacity;          ///< Allocated elements
+    rb_iter finger;             ///< Position in the searched tree
+} rb_output;
+
+/// Set operation that walks one tree and searches every key in the other one
+typedef struct rb_probe {
+    const rb_tree * other;      ///< Tree to search
+    int keep;                   ///< Keep keys found in other (1) or not found (0)
+    int other_values;           ///< Take values from other instead of the walked tree
+} rb_probe;
+
+/**
+ * @brief Append a key-value to an output sequence
+ *
+ * @param out Pointer to an output sequence.
+ * @param key Data key.
+ * @param value Data value.
+ */
+
+static void rb_output_add(rb_output * out, const char * key, void * value) {
+    if (out->count == out->capacity) {
+        out->capacity = out->capacity ? out->capacity * 2 : 64;
+        out->keys = realloc(out->keys, sizeof(char *) * out->capacity);
+        out->values = realloc(out->values, sizeof(void *) * out->capacity);
+    }
+
+    out->keys[out->count] = key;
+    out->values[out->count++] = value;
+}
+
+/**
+ * @brief Search a key of the walked tree in the other tree (map function)
+ *
+ * The first key of a run is searched from the root, and the following ones
+ * from the previous position.
+ *
+ * @param key Data key.
+ * @param value Data value.
+ * @param acc Pointer to the output of the run, or NULL for its first key.
+ * @param ctx Pointer to the set operation.
+ * @return Pointer to the output of the run.
+ */
+
+static void * rb_probe_map(const char * key, void * value, void * acc, void * ctx) {
+    const rb_probe * probe = ctx;
+    rb_output * out = acc;
+
+    if (out == NULL) {
+        out = calloc(1, sizeof(rb_output));
+        rbtree_iter_seek(probe->other, &out->finger, key);
+    } else {
+        rb_iter_advance(probe->other, &out->finger, key);
+    }
+
+    const char * found = rbtree_iter_key(&out->finger);
+    int match = found != NULL && rb_cmp(probe->other, found, key) == 0;
+
+    if (match == probe->keep) {
+        rb_output_add(out, key, match && probe->other_values ? rbtree_iter_value(&out->finger) : value);
+    }
+
+    return out;
+}
+
+/**
+ * @brief Concatenate the outputs of two adjacent runs (reduce function)
+ *
+ * @param left Pointer to the output of the first run.
+ * @param right Pointer to the output of the second run.
+ * @param ctx Unused.
+ * @return left, with right appended. right is freed.
+ */
+
+static void * rb_probe_reduce(void * left, void * right, void * ctx) {
+    rb_output * l = left;
+    rb_output * r = right;
+    (void)ctx;
+
+    for (unsigned i = 0; i < r->count; i++) {
+        rb_output_add(l, r->keys[i], r->values[i]);
+    }
+
+    free(r->keys);
+    free(r->values);
+    free(r);
+    return l;
+}
+
+/**
+ * @brief Build a tree from an output sequence
+ *
+ * @param model Pointer to the tree whose key type is copied.
+ * @param out Pointer to an output sequence, or NULL for an empty one. It is
+ *            freed.
+ * @return Pointer to a new pooled tree that shares the values.
+ */
+
+static rb_tree * rb_output_tree(const rb_tree * model, rb_output * out) {
+    rb_tree * tree = rbtree_init_pooled();
+    tree->key_type = model->key_type;
+    tree->key_size = model->key_size;
+    tree->compare = model->compare;
+
+    if (out != NULL) {
+        rb_build_tree(tree, (char * const *)out->keys, out->values, out->count);
+        free(out->keys);
+        free(out->values);
+        free(out);
+    }
+
+    return tree;
+}
+
+/**
+ * @brief Keep the keys of a tree that are (or are not) in another tree
+ *
+ * @param walk Pointer to the tree to walk.
+ * @param other Pointer to the tree to search.
+ * @param keep 1 to keep keys found in other, 0 to keep keys not found.
+ * @param other_values Take values from other instead of walk.
+ * @param model Pointer to the tree whose key type the result takes.
+ * @param nthreads Number of threads, or 0 to use all online processors.
+ * @return Pointer to a new pooled tree that shares the values.
+ */
+
+static rb_tree * rb_probe_tree(const rb_tree * walk, const rb_tree * other, int keep, int other_values, const rb_tree * model, unsigned nthreads) {
+    rb_probe probe = { other, keep, other_values };
+    rb_output * out = rb_map_reduce(walk, rb_probe_map, rb_probe_reduce, &probe, nthreads);
+    return rb_output_tree(model, out);
+}
+
+#define RB_SNAPSHOT_STEP 256     // Elements copied per read lock in rbtree_snapshot
+
+/// Snapshot being copied from a live tree
+struct rb_snap {
+    rb_tree * tree;             ///< Copy being built
+    rb_tree * added;            ///< Keys inserted into the source since the snapshot was taken
+    void * (*copy)(const void *); ///< Value copy function, or NULL to share values
+    char * cursor;              ///< Copy of the last key copied, or NULL before the first step
+    int done;                   ///< Whether all the keys have been copied
+    rb_hint hint;               ///< Last node appended to the copy
+    struct rb_snap * next;      ///< Next snapshot of the same source
+};
+
+/**
+ * @brief Check whether a key of the source has not been copied yet
+ *
+ * @param tree Pointer to the source tree.
+ * @param snap Pointer to a snapshot of tree.
+ * @param key Data key.
+ * @return 1 if the copy has not reached key yet, or 0 otherwise.
+ */
+
+static int rb_snap_pending(const rb_tree * tree, const rb_snap * snap, const char * key) {
+    return !snap->done && (snap->cursor == NULL || rb_cmp(tree, key, snap->cursor) > 0);
+}
+
+/**
+ * @brief Add a key-value to a snapshot, unless the key is already in it
+ *
+ * @param snap Pointer to a snapshot.
+ * @param key Data key.
+ * @param value Value in the source, copied if the snapshot has a copy function.
+ */
+
+static void rb_snap_put(rb_snap * snap, const char * key, void * value) {
+    int inserted;
+    rb_node * node = rb_insert(snap->tree, rb_start(snap->tree, &snap->hint, key), key, NULL, &inserted);
+
+    if (inserted) {
+        node->value = (snap->copy && value) ? snap->copy(value) : value;
+    }
+
+    rb_remember(snap->tree, &snap->hint, node);
+}
+
+/**
+ * @brief Record a key inserted into a tree while it is being copied
+ *
+ * Keys that the copies have not reached yet did not exist when the copies
+ * were taken, so they are skipped.
+ *
+ * @param tree Pointer to the source tree, locked for writing.
+ * @param key Key of the new node.
+ */
+
+static void rb_snap_added(rb_tree * tree, const char * key) {
+    for (rb_snap * snap = tree->snaps; snap != NULL; snap = snap->next) {
+        if (rb_snap_pending(tree, snap, key)) {
+            int inserted;
+            rb_insert(snap->added, snap->added->root, key, snap, &inserted);
+        }
+    }
+}
+
+/**
+ * @brief Save a node into the copies of a tree, before it changes
+ *
+ * Called before a node is removed or gets a new value. Copies that have not
+ * reached its key take its current value, unless the key was inserted after
+ * they were taken.
+ *
+ * @param tree Pointer to the source tree, locked for writing.
+ * @param node Pointer to the node about to change.
+ */
+
+static void rb_snap_keep(rb_tree * tree, const rb_node * node) {
+    for (rb_snap * snap = tree->snaps; snap != NULL; snap = snap->next) {
+        if (rb_snap_pending(tree, snap, node->key) && rb_get(snap->added, snap->added->root, node->key) == NULL) {
+            rb_snap_put(snap, node->key, node->value);
+        }
+    }
+}
+
+/**
+ * @brief Copy the next keys of a tree into a snapshot
+ *
+ * Keys saved by writers are already in the copy, and keys inserted after the
+ * snapshot was taken are skipped.
+ *
+ * @param tree Pointer to the source tree, locked for reading.
+ * @param snap Pointer to a snapshot of tree.
+ * @param budget Maximum number of keys to visit.
+ */
+
+static void rb_snap_step(const rb_tree * tree, rb_snap * snap, unsigned budget) {
+    rb_iter it;
+    const char * key = snap->cursor ? rbtree_iter_seek(tree, &it, snap->cursor) : rbtree_iter_first(tree, &it);
+    const char * last = NULL;
+
+    if (key != NULL && snap->cursor != NULL && rb_cmp(tree, key, snap->cursor) == 0) {
+        key = rbtree_iter_next(&it);
+    }
+
+    for (; key != NULL && budget > 0; key = rbtree_iter_next(&it), budget--) {
+        if (rb_get(snap->added, snap->added->root, key) == NULL) {
+            rb_snap_put(snap, key, rbtree_iter_value(&it));
+        }
+
+        last = key;
+    }
+
+    if (key == NULL) {
+        snap->done = 1;
+    } else if (last != NULL) {
+        size_t size = rb_key_size(tree, last);
+        free(snap->cursor);
+        snap->cursor = memcpy(malloc(size), last, size);
+    }
+}
+
+/**
+ * @brief Complete all the snapshots being copied from a tree
+ *
+ * Called before operations that move many keys at once, which would have to
+ * save each of them.
+ *
+ * @param tree Pointer to the source tree, locked for writing.
+ */
+
+static void rb_snap_finish(rb_tree * tree) {
+    for (rb_snap * snap = tree->snaps; snap != NULL; snap = snap->next) {
+        if (!snap->done) {
+            rb_snap_step(tree, snap, UINT_MAX);
+        }
+    }
+}
+
+/* Public functions ***********************************************************/
+
+// Create a red-black tree
+
+rb_tree * rbtree_init() {
+    rb_allocator allocator = { rb_malloc, rb_mfree, NULL, NULL };
+    return rbtree_init_with_allocator(&allocator);
+}
+
+// Create a red-black tree with a custom allocator
+
+rb_tree * rbtree_init_with_allocator(const rb_allocator * allocator) {
+    rb_tree * tree = calloc(1, sizeof(rb_tree));
+    tree->allocator = *allocator;
+#ifdef RBTREE_STATS
+    tree->stats = calloc(1, sizeof(rb_stats));
+#endif
+    return tree;
+}
+
+// Create a red-black tree with a key comparison function
+
+rb_tree * rbtree_init_with_compare(int (*compare)(const char *, const char *)) {
+    if (compare == NULL) {
+        return NULL;
+    }
+
+    rb_tree * tree = rbtree_init();
+    rbtree_set_compare(tree, compare);
+    return tree;
+}
+
+// Create a red-black tree backed by a memory pool
+
+rb_tree * rbtree_init_pooled() {
+    rb_allocator allocator = { rb_pool_alloc, rb_pool_free, rb_pool_release, rb_pool_create() };
+    return rbtree_init_with_allocator(&allocator);
+}
+
+// Build a red-black tree from a sorted array
+
+rb_tree * rbtree_build_sorted(char * const * keys, void * const * values, unsigned n) {
+    rb_tree * tree = rbtree_init_pooled();
+    rb_build_tree(tree, keys, values, n);
+    return tree;
+}
+
+// Take a point-in-time copy of a tree
+
+rb_tree * rbtree_snapshot(rb_tree * tree, void * (*copy)(const void *)) {
+    rb_snap snap = { rbtree_init_pooled(), rbtree_init_pooled(), copy, NULL, 0, { NULL, 0 }, NULL };
+    snap.tree->key_type = snap.added->key_type = tree->key_type;
+    snap.tree->key_size = snap.added->key_size = tree->key_size;
+    snap.tree->compare = snap.added->compare = tree->compare;
+    snap.tree->dispose = copy ? tree->dispose : NULL;
+
+    rb_wrlock(tree);
+    snap.next = tree->snaps;
+    tree->snaps = &snap;
+    rb_unlock(tree);
+
+    // Writers may run between steps
+    while (!snap.done) {
+        rb_rdlock(tree);
+
+        if (!snap.done) {
+            rb_snap_step(tree, &snap, RB_SNAPSHOT_STEP);
+        }
+
+        rb_unlock(tree);
+    }
+
+    rb_wrlock(tree);
+
+    for (rb_snap ** link = &tree->snaps; *link != NULL; link = &(*link)->next) {
+        if (*link == &snap) {
+            *link = snap.next;
+            break;
+        }
+    }
+
+    rb_unlock(tree);
+    rbtree_destroy(snap.added);
+    free(snap.cursor);
+    return snap.tree;
+}
+
+// Write a tree to an image file
+
+int rbtree_save(const rb_tree * tree, const char * path, size_t (*value_size)(const void *)) {
+    FILE * file = fopen(path, "wb");
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    rb_rdlock(tree);
+    int r = rb_save(tree, file, value_size);
+    rb_unlock(tree);
+
+    if (fclose(file) != 0) {
+        r = -1;
+    }
+
+    return r;
+}
+
+// Open an image file as a read-mostly tree
+
+rb_tree * rbtree_open_mmap(const char * path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(rb_image_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    char * base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    const rb_image_header * header = (const rb_image_header *)base;
+
+    // The length catches truncated files before the entries are read
+    if (memcmp(header->magic, RB_IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->length != (uint64_t)st.st_size || header->length < sizeof(rb_image_header) + sizeof(rb_image_entry) * (uint64_t)header->count || !rb_image_key_type(header) || !rb_image_entries(base)) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    rb_image * image = malloc(sizeof(rb_image));
+    image->base = base;
+    image->length = st.st_size;
+    image->count = header->count;
+    image->entries = (const rb_image_entry *)(header + 1);
+
+    rb_tree * tree = rbtree_init_pooled();
+    tree->key_type = header->key_type;
+    tree->key_size = header->key_size;
+    tree->dispose = free;
+    tree->image = image;
+    return tree;
+}
+
+// Move the nodes of a tree into a cache-friendly layout
+
+void rbtree_relayout(rb_tree * tree) {
+    rb_wrlock(tree);
+    rb_promote(tree);
+    rb_relayout(tree);
+    rb_unlock(tree);
+}
+
+// Split a tree by a key
+
+void rbtree_split(rb_tree * tree, const char * key, rb_tree ** left, rb_tree ** right) {
+    rb_wrlock(tree);
+    rb_promote(tree);
+    rb_snap_finish(tree);
+
+    rb_tree * other;
+
+    if (tree->allocator.release == NULL) {
+        other = rbtree_init_with_allocator(&tree->allocator);
+    } else if (tree->allocator.alloc == rb_pool_alloc) {
+        // Both halves hold the pool
+        rb_pool_share(tree->allocator.context);
+        other = rbtree_init_with_allocator(&tree->allocator);
+    } else {
+        // The right half is moved into a pool below
+        other = rbtree_init_pooled();
+    }
+
+    other->dispose = tree->dispose;
+    other->key_type = tree->key_type;
+    other->key_size = tree->key_size;
+    other->compare = tree->compare;
+
+    if (tree->lock != NULL) {
+        rbtree_set_concurrent(other);
+    }
+
+    rb_node * root = tree->root;
+    rb_node * l;
+    rb_node * r;
+    unsigned lh;
+    unsigned rh;
+
+    rb_split(tree, root, rb_black_height(root), key, rb_prefix(tree, key), 0, &l, &lh, &r, &rh);
+
+    // Roots may be left red
+    if (l != NULL) {
+        rb_set_color(l, RB_BLACK);
+    }
+
+    if (r != NULL) {
+        rb_set_color(r, RB_BLACK);
+    }
+
+    tree->root = l;
+    other->root = r;
+    tree->epoch++;
+    rb_ends(tree);
+    rb_ends(other);
+
+#ifdef RBTREE_THREADED
+    // Both halves are contiguous in the list, so it is only cut between them
+    if (l != NULL && r != NULL) {
+        tree->last->next = NULL;
+        other->first->prev = NULL;
+    }
+#endif
+
+    if (!rb_same_allocator(&tree->allocator, &other->allocator)) {
+        rb_move(other, &other->allocator);
+    }
+
+#ifdef RBTREE_STATS
+    rb_restat(tree);
+    rb_restat(other);
+    tree->stats->frees += rb_size(r);
+    other->stats->allocations = rb_size(r);
+#endif
+
+    rb_unlock(tree);
+    *left = tree;
+    *right = other;
+}
+
+// Concatenate two trees
+
+int rbtree_join(rb_tree * left, rb_tree * right) {
+    if (left == right) {
+        return -1;
+    }
+
+    // Lock in address order, so that concurrent joins of the same trees in
+    // opposite directions do not deadlock
+    if ((uintptr_t)left < (uintptr_t)right) {
+        rb_wrlock(left);
+        rb_wrlock(right);
+    } else {
+        rb_wrlock(right);
+        rb_wrlock(left);
+    }
+
+    rb_promote(left);
+    rb_promote(right);
+
+    if (left->root != NULL && right->root != NULL && rb_cmp(left, rb_max(left->root)->key, rb_min(right->root)->key) >= 0) {
+        rb_unlock(right);
+        rb_unlock(left);
+        return -1;
+    }
+
+    if (right->root != NULL) {
+        rb_snap_finish(left);
+    }
+
+    if (right->root != NULL && !rb_same_allocator(&left->allocator, &right->allocator)) {
+        if (left->allocator.alloc == rb_pool_alloc && right->allocator.alloc == rb_pool_alloc) {
+            // Nodes of right are freed into the pool of left, which keeps theirs alive
+            rb_pool_retain(left->allocator.context, right->allocator.context);
+        } else {
+            rb_move(right, &left->allocator);
+        }
+    }
+
+    if (right->root != NULL) {
+        // The minimum of right becomes the middle node
+        rb_node * node = rb_min(right->root);
+        rb_unlink(right, node);
+
+#ifdef RBTREE_STATS
+        left->stats->allocations += right->stats->allocations;
+        left->stats->frees += right->stats->frees;
+        left->stats->bytes += right->stats->bytes;
+        left->stats->path_length += right->stats->path_length;
+#endif
+
+#ifdef RBTREE_THREADED
+        node->prev = left->last;
+        rb_relink(node);
+#endif
+
+        rb_join(left, left->root, rb_black_height(left->root), node, right->root, rb_black_height(right->root));
+        rb_ends(left);
+        right->root = NULL;
+    }
+
+    rb_unlock(right);
+    rb_unlock(left);
+    rbtree_destroy(right);
+    return 0;
+}
+
+// Free a red-black tree
+
+void rbtree_destroy(rb_tree * tree) {
+    if (tree == NULL) {
+        return;
+    }
+
+    if (tree->root != NULL && (tree->dispose != NULL || tree->allocator.release == NULL)) {
+        rb_destroy(tree, UINT_MAX, 0);
+    }
+
+    if (tree->allocator.release != NULL) {
+        tree->allocator.release(tree->allocator.context);
+    }
+
+    if (tree->image != NULL) {
+        rb_image_close(tree->image);
+    }
+
+    if (tree->lock != NULL) {
+        pthread_rwlock_destroy(tree->lock);
+        free(tree->lock);
+    }
+
+    free(tree->finger);
+    free(tree->stats);
+    free(tree);
+}
+
+// Free a part of a red-black tree
+
+int rbtree_destroy_step(rb_tree * tree, unsigned budget) {
+    if (tree->root != NULL && (tree->dispose != NULL || tree->allocator.release == NULL)) {
+        rb_destroy(tree, budget, 0);
+
+        if (tree->root != NULL) {
+            return 0;
+        }
+    }
+
+    rbtree_destroy(tree);
+    return 1;
+}
+
+// Set free function to dispose elements
+
 void rbtree_set_dispose(rb_tree * tree, void (*dispose)(void *)) {
     tree->dispose = dispose;
 }
 
+// Set the key comparison function
+
+int rbtree_set_compare(rb_tree * tree, int (*compare)(const char *, const char *)) {
+    if (compare == NULL) {
+        return -1;
+    }
+
+    rb_wrlock(tree);
+
+    if (tree->image != NULL || tree->root != NULL) {
+        rb_unlock(tree);
+        return -1;
+    }
+
+    tree->key_type = RB_KEY_CUSTOM;
+    tree->key_size = 0;
+    tree->compare = compare;
+    rb_unlock(tree);
+    return 0;
+}
+
+// Set the key type
+
+int rbtree_set_key_type(rb_tree * tree, rb_key_type type, size_t size) {
+    if (type != RB_KEY_STRING && type != RB_KEY_U64 && type != RB_KEY_BINARY) {
+        return -1;
+    }
+
+    if (type == RB_KEY_BINARY && size == 0) {
+        return -1;
+    }
+
+    rb_wrlock(tree);
+
+    if (tree->image != NULL || tree->root != NULL) {
+        rb_unlock(tree);
+        return -1;
+    }
+
+    tree->key_type = type;
+    tree->key_size = type == RB_KEY_U64 ? sizeof(uint64_t) : type == RB_KEY_BINARY ? size : 0;
+    tree->compare = NULL;
+    rb_unlock(tree);
+    return 0;
+}
+
+// Make a tree safe for concurrent access
+
+void rbtree_set_concurrent(rb_tree * tree) {
+    if (tree->lock == NULL) {
+        tree->lock = malloc(sizeof(pthread_rwlock_t));
+        pthread_rwlock_init(tree->lock, NULL);
+    }
+}
+
+// Start searches from the last accessed node
+
+void rbtree_set_finger(rb_tree * tree) {
+    if (tree->finger == NULL) {
+        tree->finger = calloc(1, sizeof(rb_hint));
+    }
+}
+
+// Take the tree lock for reading
+
+void rbtree_rdlock(const rb_tree * tree) {
+    rb_rdlock(tree);
+}
+
+// Take the tree lock for writing
+
+void rbtree_wrlock(rb_tree * tree) {
+    rb_wrlock(tree);
+}
+
+// Release the tree lock
+
+void rbtree_unlock(const rb_tree * tree) {
+    rb_unlock(tree);
+}
+
 // Insert a key-value in the tree
 
 void * rbtree_insert(rb_tree * tree, const char * key, void * value) {
-    rb_node * node = rb_init(key, value);
-    rb_node * parent = NULL;
-    int cmp;
+    return rbtree_insert_hint(tree, key, value, rb_finger(tree));
+}
 
-    for (rb_node * t = tree->root; t != NULL; t = cmp < 0 ? t->left : t->right) {
-        parent = t;
-        cmp = strcmp(key, t->key);
+// Insert a key-value in the tree, starting from a hint
 
-        if (cmp == 0) {
-            // Duplicate key. Do not dispose value.
-            rb_destroy(node, NULL);
-            return NULL;
+void * rbtree_insert_hint(rb_tree * tree, const char * key, void * value, rb_hint * hint) {
+    int inserted;
+
+    // On duplicate key, do not dispose value.
+    rb_wrlock(tree);
+    rb_promote(tree);
+    rb_node * node = rb_insert(tree, rb_start(tree, hint, key), key, value, &inserted);
+    rb_remember(tree, hint, node);
+    rb_unlock(tree);
+    return inserted ? value : NULL;
+}
+
+// Insert or update a key-value
+
+void * rbtree_upsert(rb_tree * tree, const char * key, void * value) {
+    int inserted;
+
+    rb_wrlock(tree);
+    rb_promote(tree);
+    rb_hint * finger = rb_finger(tree);
+    rb_node * node = rb_insert(tree, rb_start(tree, finger, key), key, value, &inserted);
+    rb_remember(tree, finger, node);
+
+    if (!inserted && node->value != value) {
+        rb_snap_keep(tree, node);
+
+        if (node->value && tree->dispose) {
+            tree->dispose(node->value);
         }
+
+        node->value = value;
     }
 
-    if (parent == NULL) {
-        tree->root = node;
-    } else if (cmp < 0) {
-        parent->left = node;
-    } else {
-        parent->right = node;
+    rb_unlock(tree);
+    return value;
+}
+
+// Get the value slot of a key, inserting the key if missing
+
+void ** rbtree_insert_or_get(rb_tree * tree, const char * key, int * inserted) {
+    int dummy;
+
+    rb_wrlock(tree);
+    rb_promote(tree);
+    rb_hint * finger = rb_finger(tree);
+    rb_node * node = rb_insert(tree, rb_start(tree, finger, key), key, NULL, inserted ? inserted : &dummy);
+    rb_remember(tree, finger, node);
+
+    // The caller may write the slot
+    if (!(inserted ? *inserted : dummy)) {
+        rb_snap_keep(tree, node);
     }
 
-    node->parent = parent;
-    rb_balance_insert(tree, node);
+    rb_unlock(tree);
+    return &node->value;
+}
 
-    return value;
+// Insert a batch of key-values in the tree
+
+unsigned rbtree_insert_batch(rb_tree * tree, char * const * keys, void * const * values, unsigned n) {
+    rb_entry * entries = malloc(sizeof(rb_entry) * (n ? n : 1));
+    rb_node * finger = NULL;
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        entries[i].tree = tree;
+        entries[i].key = keys[i];
+        entries[i].value = values ? values[i] : NULL;
+        entries[i].index = i;
+    }
+
+    qsort(entries, n, sizeof(rb_entry), rb_entry_cmp);
+    rb_wrlock(tree);
+    rb_promote(tree);
+
+    for (unsigned i = 0; i < n; i++) {
+        rb_node * start = finger ? rb_finger_up(tree, finger, entries[i].key) : tree->root;
+        int inserted;
+
+        finger = rb_insert(tree, start, entries[i].key, entries[i].value, &inserted);
+        count += inserted;
+    }
+
+    rb_unlock(tree);
+    free(entries);
+    return count;
 }
 
 // Update the value of an existing key
 
 void * rbtree_replace(rb_tree * tree, const char * key, void * value) {
-    rb_node * node = rb_get(tree->root, key);
+    rb_wrlock(tree);
+    rb_promote(tree);
 
-    if (node == NULL) {
-        return NULL;
-    }
+    rb_hint * finger = rb_finger(tree);
+    rb_node * node = rb_get(tree, rb_start(tree, finger, key), key);
+    rb_remember(tree, finger, node);
 
-    if (node->value && tree->dispose) {
-        tree->dispose(node->value);
-    }
+    if (node != NULL) {
+        rb_snap_keep(tree, node);
 
-    node->value = value;
+        if (node->value && tree->dispose) {
+            tree->dispose(node->value);
+        }
 
-    return value;
+        node->value = value;
+    }
+
+    rb_unlock(tree);
+    return node ? value : NULL;
 }
 
 // Retrieve a value from the tree
 
 void * rbtree_get(const rb_tree * tree, const char * key) {
-    rb_node * node = rb_get(tree->root, key);
-    return node ? node->value : NULL;
+    return rbtree_get_hint(tree, key, rb_finger(tree));
 }
 
-// Remove a value from the tree
+// Retrieve a value from the tree, starting from a hint
 
-int rbtree_delete(rb_tree * tree, const char * key) {
-    rb_node * node = rb_get(tree->root, key);
+void * rbtree_get_hint(const rb_tree * tree, const char * key, rb_hint * hint) {
+    void * value = NULL;
+    rb_rdlock(tree);
 
-    if (node == NULL) {
-        return 0;
+    if (tree->image != NULL) {
+        unsigned index = rb_image_find(tree, key);
+        value = index < tree->image->count ? rb_image_value(tree->image, index) : NULL;
+    } else {
+        rb_node * node = rb_get(tree, rb_start(tree, hint, key), key);
+        rb_remember(tree, hint, node);
+        value = node ? node->value : NULL;
     }
 
-    // Succesor: node that will be actually deleted
-    rb_node * s = (node->left != NULL && node->right != NULL) ? rb_min(node->right) : node;
-    rb_node * t = (s->left != NULL) ? s->left : s->right;
+    rb_unlock(tree);
+    return value;
+}
 
-    if (s->parent == NULL) {
-        tree->root = t;
-    } else if (s == s->parent->left) {
-        s->parent->left = t;
-    } else {
-        s->parent->right = t;
-    }
+// Remove a value from the tree
 
-    if (t != NULL) {
-        t->parent = s->parent;
-    }
+int rbtree_delete(rb_tree * tree, const char * key) {
+    rb_wrlock(tree);
+    rb_promote(tree);
+    rb_hint * finger = rb_finger(tree);
+    rb_node * node = rb_get(tree, rb_start(tree, finger, key), key);
 
-    free(node->key);
+    if (node != NULL) {
+        rb_node * near = NULL;
 
-    if (node->value && tree->dispose) {
-        tree->dispose(node->value);
+        // The finger moves to a neighbor, which survives the deletion
+        if (finger != NULL) {
+            near = rb_next(node);
+            near = near != NULL ? near : rb_prev(node);
+        }
+
+        rb_delete(tree, node);
+        rb_remember(tree, finger, near);
     }
 
-    if (node != s) {
-        // Copy successor into node
+    rb_unlock(tree);
+    return node != NULL;
+}
 
-        node->key = s->key;
-        node->value = s->value;
-    }
+// Remove all the values in a range of keys
+
+unsigned rbtree_delete_range(rb_tree * tree, const char * min, const char * max) {
+    rb_wrlock(tree);
+    rb_promote(tree);
+
+    unsigned count = rb_count_range(tree, min, max);
 
-    if (s->color == RB_BLACK) {
-        rb_balance_delete(tree, t, s->parent);
+    if (count > 0) {
+        rb_snap_finish(tree);
+        rb_delete_range(tree, min, max);
     }
 
-    free(s);
-    return 1;
+    rb_unlock(tree);
+    return count;
 }
 
 // Get the minimum key in the tree
 
 const char * rbtree_minimum(const rb_tree * tree) {
-    return tree->root ? rb_min(tree->root)->key : NULL;
+    rb_rdlock(tree);
+    unsigned n = rb_count(tree);
+    const char * key = tree->image ? (n ? rb_image_key(tree->image, 0) : NULL) : tree->first ? tree->first->key : NULL;
+    rb_unlock(tree);
+    return key;
 }
 
 // Get the maximum key in the tree
 
 const char * rbtree_maximum(const rb_tree * tree) {
-    return tree->root ? rb_max(tree->root)->key : NULL;
+    rb_rdlock(tree);
+    unsigned n = rb_count(tree);
+    const char * key = tree->image ? (n ? rb_image_key(tree->image, n - 1) : NULL) : tree->last ? tree->last->key : NULL;
+    rb_unlock(tree);
+    return key;
 }
 
-// Get all the keys in the tree
+// Remove the element with the minimum key
 
-char ** rbtree_keys(const rb_tree * tree) {
-    unsigned size = 0;
-    char ** array = malloc(sizeof(char *));
+char * rbtree_pop_min(rb_tree * tree, void ** value) {
+    rb_wrlock(tree);
+    rb_promote(tree);
+    char * key = tree->first ? rb_pop(tree, tree->first, value) : NULL;
+    rb_unlock(tree);
+    return key;
+}
 
-    if (tree->root != NULL) {
-        array = rb_keys(tree->root, array, &size);
-    }
+// Remove the element with the maximum key
+
+char * rbtree_pop_max(rb_tree * tree, void ** value) {
+    rb_wrlock(tree);
+    rb_promote(tree);
+    char * key = tree->last ? rb_pop(tree, tree->last, value) : NULL;
+    rb_unlock(tree);
+    return key;
+}
 
-    array[size] = NULL;
+// Get all the keys in the tree
+
+char ** rbtree_keys(const rb_tree * tree) {
+    rb_rdlock(tree);
+    char ** array = tree->image ? rb_image_keys(tree, 0, tree->image->count) : rb_keys(tree, tree->first, rb_size(tree->root));
+    rb_unlock(tree);
     return array;
 }
 
 // Get all the keys from the tree within a range
 
 char ** rbtree_range(const rb_tree * tree, const char * min, const char * max) {
-    unsigned size = 0;
-    char ** array = malloc(sizeof(char *));
+    rb_rdlock(tree);
+    char ** array = tree->image ? rb_image_keys(tree, rb_image_rank(tree, min, 0), rb_count_range(tree, min, max)) : rb_keys(tree, rb_lower_bound(tree, tree->root, min), rb_count_range(tree, min, max));
+    rb_unlock(tree);
+    return array;
+}
 
-    if (tree->root != NULL) {
-        array = rb_range(tree->root, min, max, array, &size);
+// Visit the elements of the tree within a range
+
+int rbtree_foreach_range(const rb_tree * tree, const char * min, const char * max, int (*fn)(const char * key, void * value, void * ctx), void * ctx) {
+    int r = 0;
+    rb_rdlock(tree);
+
+    if (tree->image != NULL) {
+        unsigned end = rb_image_rank(tree, max, 1);
+
+        for (unsigned i = rb_image_rank(tree, min, 0); i < end && r == 0; i++) {
+            r = fn(rb_image_key(tree->image, i), rb_image_value(tree->image, i), ctx);
+        }
+
+        rb_unlock(tree);
+        return r;
     }
 
-    array[size] = NULL;
-    return array;
+    uint64_t prefix = rb_prefix(tree, max);
+
+    for (rb_node * node = rb_lower_bound(tree, tree->root, min); node != NULL && rb_cmp_node(tree, max, prefix, node) >= 0 && r == 0; node = rb_next(node)) {
+        r = fn(node->key, node->value, ctx);
+    }
+
+    rb_unlock(tree);
+    return r;
 }
 
-// Get the black depth of a tree
+// Visit all the elements of the tree with a number of threads
 
-int rbtree_black_depth(const rb_tree * tree) {
-    if (tree->root == NULL) {
-        return 0;
+int rbtree_foreach_parallel(const rb_tree * tree, int (*fn)(const char * key, void * value, void * ctx), void * ctx, unsigned nthreads) {
+    rb_job job = { .tree = tree, .fn = fn, .ctx = ctx };
+
+    rb_rdlock(tree);
+    rb_parallel(&job, nthreads);
+    rb_unlock(tree);
+
+    free(job.tasks);
+    return job.result;
+}
+
+// Fold all the elements of the tree with a number of threads
+
+void * rbtree_map_reduce(const rb_tree * tree, void * (*map)(const char * key, void * value, void * acc, void * ctx), void * (*reduce)(void * left, void * right, void * ctx), void * ctx, unsigned nthreads) {
+    rb_rdlock(tree);
+    void * acc = rb_map_reduce(tree, map, reduce, ctx, nthreads);
+    rb_unlock(tree);
+    return acc;
+}
+
+// Get the union of two trees
+
+rb_tree * rbtree_union(const rb_tree * a, const rb_tree * b) {
+    rb_output * out = calloc(1, sizeof(rb_output));
+    rb_iter ia;
+    rb_iter ib;
+
+    rb_rdlock(a);
+    rb_rdlock(b);
+
+    const char * ka = rbtree_iter_first(a, &ia);
+    const char * kb = rbtree_iter_first(b, &ib);
+
+    while (ka != NULL || kb != NULL) {
+        int cmp = ka == NULL ? 1 : kb == NULL ? -1 : rb_cmp(a, ka, kb);
+
+        if (cmp <= 0) {
+            rb_output_add(out, ka, rbtree_iter_value(&ia));
+            ka = rbtree_iter_next(&ia);
+        } else {
+            rb_output_add(out, kb, rbtree_iter_value(&ib));
+        }
+
+        if (cmp >= 0) {
+            kb = rbtree_iter_next(&ib);
+        }
     }
 
-    if (tree->root->color == RB_RED) {
-        return -1;
+    rb_tree * tree = rb_output_tree(a, out);
+
+    rb_unlock(b);
+    rb_unlock(a);
+    return tree;
+}
+
+// Get the intersection of two trees
+
+rb_tree * rbtree_intersection(const rb_tree * a, const rb_tree * b, unsigned nthreads) {
+    rb_rdlock(a);
+    rb_rdlock(b);
+
+    // Walk the smaller tree, and search its keys in the larger one
+    rb_tree * tree = rb_count(a) <= rb_count(b) ? rb_probe_tree(a, b, 1, 0, a, nthreads) : rb_probe_tree(b, a, 1, 1, a, nthreads);
+
+    rb_unlock(b);
+    rb_unlock(a);
+    return tree;
+}
+
+// Get the difference of two trees
+
+rb_tree * rbtree_difference(const rb_tree * a, const rb_tree * b, unsigned nthreads) {
+    rb_rdlock(a);
+    rb_rdlock(b);
+    rb_tree * tree = rb_probe_tree(a, b, 0, 0, a, nthreads);
+    rb_unlock(b);
+    rb_unlock(a);
+    return tree;
+}
+
+// Compare two trees
+
+int rbtree_diff(const rb_tree * old, const rb_tree * new, int (*equal)(const void *, const void *), int (*fn)(rb_diff change, const char * key, void * old_value, void * new_value, void * ctx), void * ctx) {
+    rb_iter io;
+    rb_iter in;
+    int r = 0;
+
+    rb_rdlock(old);
+    rb_rdlock(new);
+
+    const char * ko = rbtree_iter_first(old, &io);
+    const char * kn = rbtree_iter_first(new, &in);
+
+    while ((ko != NULL || kn != NULL) && r == 0) {
+        int cmp = ko == NULL ? 1 : kn == NULL ? -1 : rb_cmp(old, ko, kn);
+
+        if (cmp < 0) {
+            r = fn(RB_DIFF_REMOVED, ko, rbtree_iter_value(&io), NULL, ctx);
+            ko = rbtree_iter_next(&io);
+        } else if (cmp > 0) {
+            r = fn(RB_DIFF_ADDED, kn, NULL, rbtree_iter_value(&in), ctx);
+            kn = rbtree_iter_next(&in);
+        } else {
+            void * vo = rbtree_iter_value(&io);
+            void * vn = rbtree_iter_value(&in);
+
+            if (equal ? !equal(vo, vn) : vo != vn) {
+                r = fn(RB_DIFF_CHANGED, ko, vo, vn, ctx);
+            }
+
+            ko = rbtree_iter_next(&io);
+            kn = rbtree_iter_next(&in);
+        }
     }
 
-    int d_left = rb_black_depth(tree->root->left);
-    int d_right = rb_black_depth(tree->root->right);
+    rb_unlock(new);
+    rb_unlock(old);
+    return r;
+}
+
+// Get the black depth of a tree
+
+int rbtree_black_depth(const rb_tree * tree) {
+    int depth = 0;
+    rb_rdlock(tree);
+
+    if (tree->image != NULL) {
+        depth = rb_image_black_depth(tree->image);
+    } else if (tree->root != NULL) {
+        if (rb_node_color(tree->root) == RB_RED) {
+            depth = -1;
+        } else {
+            depth = rb_black_depth(tree->root);
+            depth = depth == -1 ? -1 : depth - 1;
+        }
+    }
 
-    return (d_left == -1 || d_right == -1 || d_left != d_right) ? -1 : d_left;
+    rb_unlock(tree);
+    return depth;
 }
 
 // Get the size of the tree
 
 unsigned rbtree_size(const rb_tree * tree) {
-    return tree->root ? rb_size(tree->root) : 0;
+    rb_rdlock(tree);
+    unsigned size = rb_count(tree);
+    rb_unlock(tree);
+    return size;
+}
+
+// Get the rank of a key
+
+unsigned rbtree_rank(const rb_tree * tree, const char * key) {
+    rb_rdlock(tree);
+    unsigned rank = rb_rank(tree, key, 0);
+    rb_unlock(tree);
+    return rank;
+}
+
+// Get the key at a given position
+
+const char * rbtree_select(const rb_tree * tree, unsigned index) {
+    rb_rdlock(tree);
+
+    if (tree->image != NULL) {
+        const char * key = index < tree->image->count ? rb_image_key(tree->image, index) : NULL;
+        rb_unlock(tree);
+        return key;
+    }
+
+    rb_node * node = rb_select(tree, index);
+    rb_unlock(tree);
+    return node ? node->key : NULL;
+}
+
+// Count the keys within a range
+
+unsigned rbtree_count_range(const rb_tree * tree, const char * min, const char * max) {
+    rb_rdlock(tree);
+    unsigned count = rb_count_range(tree, min, max);
+    rb_unlock(tree);
+    return count;
+}
+
+// Get tree statistics
+
+rb_stats rbtree_stats(const rb_tree * tree) {
+    rb_stats stats = { 0 };
+    rb_rdlock(tree);
+
+#ifdef RBTREE_STATS
+    // Readers update comparisons concurrently
+    stats.comparisons = __atomic_load_n(&tree->stats->comparisons, __ATOMIC_RELAXED);
+    stats.rotations = tree->stats->rotations;
+    stats.recolorings = tree->stats->recolorings;
+    stats.insert_fixups = tree->stats->insert_fixups;
+    stats.delete_fixups = tree->stats->delete_fixups;
+    stats.allocations = tree->stats->allocations;
+    stats.frees = tree->stats->frees;
+    stats.bytes = tree->stats->bytes;
+    // Images have no nodes yet, but their shape is known
+    stats.path_length = tree->image ? rb_image_path_length(tree->image) : tree->stats->path_length;
+#endif
+
+    stats.size = rb_count(tree);
+
+    if (tree->image != NULL) {
+        stats.black_depth = rb_image_black_depth(tree->image);
+    } else {
+        for (const rb_node * node = tree->root; node != NULL; node = node->left) {
+            stats.black_depth += rb_node_color(node) == RB_BLACK;
+        }
+    }
+
+    stats.max_height = 2 * stats.black_depth;
+    stats.average_depth = stats.size ? (double)stats.path_length / stats.size : 0;
+    rb_unlock(tree);
+    return stats;
+}
+
+// Compute the path length of a tree
+
+uint64_t rbtree_path_length(const rb_tree * tree) {
+    rb_rdlock(tree);
+    uint64_t path_length = tree->image ? rb_image_path_length(tree->image) : rb_path_length(tree, NULL);
+    rb_unlock(tree);
+    return path_length;
 }
 
 // Check whether the tree is empty
 
 int rbtree_empty(const rb_tree * tree) {
-    return tree->root == NULL;
+    rb_rdlock(tree);
+    int empty = rb_count(tree) == 0;
+    rb_unlock(tree);
+    return empty;
+}
+
+// Move an iterator to the minimum key
+
+const char * rbtree_iter_first(const rb_tree * tree, rb_iter * iter) {
+    iter->image = tree->image;
+    iter->index = 0;
+    iter->node = tree->first;
+    return rbtree_iter_key(iter);
+}
+
+// Move an iterator to the maximum key
+
+const char * rbtree_iter_last(const rb_tree * tree, rb_iter * iter) {
+    iter->image = tree->image;
+    iter->index = rb_count(tree) ? rb_count(tree) - 1 : 0;
+    iter->node = tree->last;
+    return rbtree_iter_key(iter);
+}
+
+// Move an iterator to the first key not lower than a key
+
+const char * rbtree_iter_seek(const rb_tree * tree, rb_iter * iter, const char * key) {
+    iter->image = tree->image;
+    iter->index = tree->image ? rb_image_rank(tree, key, 0) : 0;
+    iter->node = tree->image ? NULL : rb_lower_bound(tree, tree->root, key);
+    return rbtree_iter_key(iter);
+}
+
+// Move an iterator to the next key
+
+const char * rbtree_iter_next(rb_iter * iter) {
+    if (iter->image != NULL) {
+        iter->index++;
+        return rbtree_iter_key(iter);
+    }
+
+    iter->node = rb_next(iter->node);
+    return rbtree_iter_key(iter);
+}
+
+// Move an iterator to the previous key
+
+const char * rbtree_iter_prev(rb_iter * iter) {
+    if (iter->image != NULL) {
+        // Past the start is past the end too
+        iter->index = iter->index ? iter->index - 1 : iter->image->count;
+        return rbtree_iter_key(iter);
+    }
+
+    iter->node = rb_prev(iter->node);
+    return rbtree_iter_key(iter);
+}
+
+// Get the key at an iterator
+
+const char * rbtree_iter_key(const rb_iter * iter) {
+    if (iter->image != NULL) {
+        return iter->index < iter->image->count ? rb_image_key(iter->image, iter->index) : NULL;
+    }
+
+    return iter->node ? iter->node->key : NULL;
+}
+
+// Get the value at an iterator
+
+void * rbtree_iter_value(const rb_iter * iter) {
+    return iter->image ? rb_image_value(iter->image, iter->index) : iter->node->value;
 }
@@ -18,31 +18,163 @@
 #ifndef RBTREE_H
 #define RBTREE_H
 
-/// Possible colors of a red-black tree
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/// Possible colors of a red-black tree, as stored in rb_node.parent_color
 typedef enum rb_color { RB_RED, RB_BLACK } rb_color;
 
-/// Red-black tree node
+/**
+ * @brief Key types
+ *
+ * Keys are always passed as const char *. For fixed-size types, they point
+ * to the key bytes, which are copied into the node.
+ */
+typedef enum rb_key_type {
+    RB_KEY_STRING,              ///< Null-terminated string, ordered by strcmp
+    RB_KEY_U64,                 ///< uint64_t in host byte order, ordered numerically
+    RB_KEY_BINARY,              ///< Fixed-size byte array, ordered by memcmp
+    RB_KEY_CUSTOM               ///< Null-terminated string, ordered by a custom function
+} rb_key_type;
+
+/// Kinds of change reported by rbtree_diff
+typedef enum rb_diff {
+    RB_DIFF_ADDED,              ///< The key is only in the new tree
+    RB_DIFF_REMOVED,            ///< The key is only in the old tree
+    RB_DIFF_CHANGED             ///< The key is in both trees, with different values
+} rb_diff;
+
+/// Pass a uint64_t value as a key of a RB_KEY_U64 tree
+#define RB_U64(x) ((const char *)&(uint64_t){ (x) })
+
+/**
+ * @brief Red-black tree node
+ *
+ * The key is stored right after the node header, in the same block, so that
+ * comparisons do not need to follow a pointer. Its first 8 bytes are also
+ * cached as an integer, so most comparisons do not read the key at all.
+ *
+ * The color is kept in the lowest bit of the parent pointer, which is always
+ * zero since nodes are aligned, so the header takes 44 bytes on 64-bit
+ * systems.
+ *
+ * If RBTREE_THREADED is defined, nodes also link to their in-order
+ * neighbors, so that iteration steps in constant time without climbing the
+ * tree, at the cost of two more pointers per node. The library and its
+ * users must be built with the same setting.
+ */
 typedef struct rb_node {
-    char * key;                 ///< Node key
     void * value;               ///< Pointer to value
-    rb_color color;             ///< Node color
-    struct rb_node * parent;    ///< Pointer to parent node
+    uintptr_t parent_color;     ///< Pointer to parent node, ORed with the node color
     struct rb_node * left;      ///< Pointer to left child
     struct rb_node * right;     ///< Pointer to right child
+#ifdef RBTREE_THREADED
+    struct rb_node * next;      ///< Pointer to the in-order successor
+    struct rb_node * prev;      ///< Pointer to the in-order predecessor
+#endif
+    uint64_t prefix;            ///< First bytes of the key, to compare without reading it
+    unsigned size;              ///< Number of nodes in the subtree
+    char key[];                 ///< Node key
 } rb_node;
 
+/**
+ * @brief Memory allocator for nodes
+ *
+ * Every block is released with the same size that it was requested with, so
+ * size-class allocators do not need to keep headers. Blocks must be aligned
+ * for a pointer.
+ */
+typedef struct rb_allocator {
+    void * (*alloc)(void * context, size_t size);           ///< Allocate a block
+    void (*free)(void * context, void * ptr, size_t size);  ///< Free a block
+    void (*release)(void * context);                        ///< Free all blocks at once (optional)
+    void * context;                                         ///< Allocator state
+} rb_allocator;
+
+/**
+ * @brief Tree statistics
+ *
+ * Operation counters, and the path length that yields the average depth, are
+ * only kept if the library is built with RBTREE_STATS defined. Otherwise,
+ * they are zero. Counters are cumulative since the tree was created.
+ */
+typedef struct rb_stats {
+    uint64_t comparisons;       ///< Key comparisons
+    uint64_t rotations;         ///< Left and right rotations
+    uint64_t recolorings;       ///< Color changes while rebalancing
+    uint64_t insert_fixups;     ///< Iterations of the insertion rebalancing loop
+    uint64_t delete_fixups;     ///< Iterations of the deletion rebalancing loop
+    uint64_t allocations;       ///< Nodes allocated
+    uint64_t frees;             ///< Nodes freed
+    uint64_t bytes;             ///< Bytes held by nodes, including keys
+    uint64_t path_length;       ///< Sum of the depths of all nodes, with the root at 0
+    unsigned size;              ///< Number of elements
+    int black_depth;            ///< Black depth, as rbtree_black_depth returns it
+    unsigned max_height;        ///< Upper bound of the number of nodes from the root to any leaf
+    double average_depth;       ///< Average node depth
+} rb_stats;
+
+/// Image file mapped in memory (see rbtree_open_mmap)
+typedef struct rb_image rb_image;
+
+/// Snapshot being copied from a tree (see rbtree_snapshot)
+typedef struct rb_snap rb_snap;
+
+/**
+ * @brief Position of a previous access, to start a search from
+ *
+ * A hint remembers the last node found through it. Searches climb from that
+ * node only as far as needed, so nearby keys are found in time logarithmic
+ * in their distance, rather than in the tree size. Hints are checked against
+ * the tree epoch, so a hint that is stale because nodes were freed or moved
+ * just falls back to a search from the root.
+ *
+ * Initialize hints to zero, and use each one with a single tree.
+ */
+typedef struct rb_hint {
+    struct rb_node * node;      ///< Last node found, or NULL
+    unsigned long epoch;        ///< Tree epoch when node was found
+} rb_hint;
+
 /**
  * @brief Red-black tree abstract data type
  *
  * A red-black tree is a self-balanced binary search tree.
  *
- * It supports O(log n) insertion, deletion and search.
+ * It supports O(log n) insertion, deletion and search. Every node keeps the
+ * size of its subtree, so order statistics are also O(log n).
  */
 typedef struct rb_tree {
     rb_node * root;             ///< Pointer to root node
+    rb_node * first;            ///< Pointer to the node with the minimum key
+    rb_node * last;             ///< Pointer to the node with the maximum key
     void (*dispose)(void *);    ///< Pointer to function to dispose an element
+    rb_allocator allocator;     ///< Node allocator
+    pthread_rwlock_t * lock;    ///< Reader-writer lock, if the tree is concurrent
+    rb_key_type key_type;       ///< Key type
+    size_t key_size;            ///< Key size for fixed-size keys, or 0 for strings
+    int (*compare)(const char *, const char *); ///< Key comparison function for RB_KEY_CUSTOM
+    rb_image * image;           ///< Mapped image that serves reads until the first write, or NULL
+    rb_stats * stats;           ///< Operation counters, if built with RBTREE_STATS, or NULL
+    unsigned long epoch;        ///< Incremented whenever nodes are freed or moved, to validate hints
+    rb_hint * finger;           ///< Last accessed node, if enabled by rbtree_set_finger, or NULL
+    rb_snap * snaps;            ///< Snapshots being copied from the tree, or NULL
 } rb_tree;
 
+/**
+ * @brief In-order cursor over a red-black tree
+ *
+ * Iterators borrow the tree nodes: they do not allocate, and they are
+ * invalidated if their current node is deleted. Iterator functions do not
+ * lock concurrent trees: hold rbtree_rdlock while iterating.
+ */
+typedef struct rb_iter {
+    rb_node * node;             ///< Current node, or NULL past the end
+    const rb_image * image;     ///< Mapped image of the tree, if any
+    unsigned index;             ///< Current position in the image
+} rb_iter;
+
 /**
  * @brief Create a red-black tree
  *
@@ -51,17 +183,232 @@ typedef struct rb_tree {
 
 rb_tree * rbtree_init();
 
+/**
+ * @brief Create a red-black tree with a custom allocator
+ *
+ * Nodes are allocated through the given allocator. If it defines a
+ * release function, rbtree_destroy calls it once instead of freeing every
+ * node.
+ *
+ * @param allocator Pointer to an allocator. It will be copied.
+ * @return Pointer to an empty tree.
+ */
+
+rb_tree * rbtree_init_with_allocator(const rb_allocator * allocator);
+
+/**
+ * @brief Create a red-black tree with a key comparison function
+ *
+ * Keys are null-terminated strings, ordered by compare instead of strcmp
+ * (see rbtree_set_compare).
+ *
+ * @param compare Pointer to a function that returns a negative, zero or
+ *                positive value if the first key is lower than, equal to or
+ *                greater than the second one.
+ * @return Pointer to an empty tree.
+ * @retval NULL compare is NULL.
+ */
+
+rb_tree * rbtree_init_with_compare(int (*compare)(const char *, const char *));
+
+/**
+ * @brief Create a red-black tree backed by a memory pool
+ *
+ * Nodes are carved from large chunks, and freed blocks are recycled
+ * through per-size free lists. Chunks are returned to the system only when
+ * the tree is destroyed, in O(chunks) if no dispose function is set.
+ *
+ * @return Pointer to an empty tree.
+ */
+
+rb_tree * rbtree_init_pooled();
+
+/**
+ * @brief Build a red-black tree from a sorted array
+ *
+ * The tree is built in linear time, without comparisons or rebalancing. All
+ * nodes are allocated in pre-order from a single contiguous block of a pooled
+ * tree (see rbtree_init_pooled).
+ *
+ * @param keys Array of n string keys, in strictly increasing order.
+ * @param values Array of n values, or NULL to set all values to NULL.
+ * @param n Number of elements.
+ * @pre keys are sorted and have no duplicates. This is not checked.
+ * @return Pointer to a new tree holding all the elements.
+ */
+
+rb_tree * rbtree_build_sorted(char * const * keys, void * const * values, unsigned n);
+
+/**
+ * @brief Take a point-in-time copy of a tree
+ *
+ * This is a full copy, not a cheap structural snapshot: it takes linear time
+ * and memory. On a concurrent tree, the copy runs in steps of a few hundred
+ * elements, each under the read lock, so writers wait for one step at most
+ * instead of the whole copy. A writer that changes or removes a key that the
+ * copy has not reached yet saves its previous value into the copy first, in
+ * O(log n), and keys inserted meanwhile are skipped. The result holds the
+ * elements of the tree at the time of the call.
+ *
+ * rbtree_split, rbtree_join and rbtree_delete_range move many keys at once,
+ * so they complete any copy in progress before they run. The tree must not be
+ * destroyed while it is being copied.
+ *
+ * The snapshot is an independent tree. Since nothing writes to it, any number
+ * of threads may read it without locking.
+ *
+ * Keys are always copied, and the snapshot keeps the key type and comparison
+ * function of the source. Values are copied with the copy function, if
+ * given, and then disposed with the source's dispose function when the
+ * snapshot is destroyed. Otherwise they are shared with the source tree and
+ * never disposed by the snapshot, so they must outlive it.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param copy Pointer to a function to copy a value, or NULL to share values.
+ * @return Pointer to a new pooled tree holding the same elements.
+ */
+
+rb_tree * rbtree_snapshot(rb_tree * tree, void * (*copy)(const void *));
+
+/**
+ * @brief Write a tree to an image file
+ *
+ * The image holds the elements in key order, with offsets instead of
+ * pointers, so that rbtree_open_mmap can use it in place. It is tied to the
+ * byte order and word size of the machine that wrote it.
+ *
+ * Values are saved as value_size bytes each. If value_size is NULL, values
+ * are not saved and the image holds NULL values.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param path Path of the file to write. It is truncated if it exists.
+ * @param value_size Pointer to a function that returns the size of a value,
+ *                   or NULL.
+ * @retval 0 Success.
+ * @retval -1 The file could not be written.
+ */
+
+int rbtree_save(const rb_tree * tree, const char * path, size_t (*value_size)(const void *));
+
+/**
+ * @brief Open an image file as a tree
+ *
+ * The file is mapped in memory, and read functions (rbtree_get, ranges,
+ * order statistics, iterators...) search it directly, with no parsing or
+ * allocation, so opening takes constant time. Values point into a private
+ * mapping: they can be modified, but changes are not written to the file.
+ *
+ * The first function that modifies the tree builds the nodes from the image
+ * in linear time, as rbtree_build_sorted does, and unmaps it. At that point,
+ * values are copied into blocks allocated with malloc, and references
+ * obtained before are invalid. The tree disposes values with free, unless
+ * another dispose function is set.
+ *
+ * Trees of custom-ordered keys must call rbtree_set_compare before any other
+ * function. rbtree_set_key_type must not be called.
+ *
+ * @param path Path of a file written by rbtree_save.
+ * @return Pointer to a pooled tree holding the saved elements.
+ * @retval NULL The file could not be mapped, or it is not a valid image: its
+ *              signature, key type or length do not match, or its entries
+ *              point outside of it.
+ */
+
+rb_tree * rbtree_open_mmap(const char * path);
+
+/**
+ * @brief Move the nodes of a tree into a cache-friendly layout
+ *
+ * Nodes are copied into a single contiguous block in van Emde Boas order:
+ * every subtree of 2^k levels is stored in a contiguous span, so a search
+ * touches O(log n / log B) cache lines for any line size B, instead of about
+ * one per level. This runs in O(n log log n) time.
+ *
+ * The tree then allocates from a memory pool, as if it had been created by
+ * rbtree_init_pooled, and the previous allocator is not used anymore. Nodes
+ * inserted later are not placed in layout order, so call this again after a
+ * large number of insertions.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @post Iterators, keys and value slots obtained before are invalid. Values
+ *       themselves are not copied.
+ */
+
+void rbtree_relayout(rb_tree * tree);
+
+/**
+ * @brief Split a tree by a key
+ *
+ * The tree keeps the keys lower than key, and a new tree with the same
+ * settings takes the rest. Nodes are moved, not copied, and the split runs
+ * in O(log n). In builds with RBTREE_STATS, the path length of both trees
+ * is recomputed, which takes linear time.
+ *
+ * Pooled trees share their pool between both halves, and it is freed along
+ * with the last of them. A tree with an image is loaded first. With any other
+ * allocator that has a release function, the new tree is pooled and its nodes
+ * are copied, in linear time in its size.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Split key.
+ * @param[out] left Set to tree.
+ * @param[out] right Set to a new tree with the keys greater than or equal
+ *                   to key.
+ */
+
+void rbtree_split(rb_tree * tree, const char * key, rb_tree ** left, rb_tree ** right);
+
+/**
+ * @brief Concatenate two trees
+ *
+ * All keys in left must be lower than all keys in right. The nodes of right
+ * are moved into left, in O(log n), and right is destroyed.
+ *
+ * If both trees are pooled, the pool of left keeps the pool of right alive.
+ * Otherwise, if the allocators differ, the nodes of right are copied into the
+ * allocator of left, in linear time in the size of right.
+ *
+ * @param left Pointer to a red-black tree.
+ * @param right Pointer to a red-black tree with the same settings as left.
+ * @retval 0 The trees were joined.
+ * @retval -1 The keys overlap, or left and right are the same tree. No tree
+ *            is modified.
+ */
+
+int rbtree_join(rb_tree * left, rb_tree * right);
+
 /**
  * @brief Free a red-black tree
  *
  * If tree is NULL, no operation is performed.
  *
  * @post The tree is destroyed, including keys and values.
+ * @note Pooled trees release their memory chunk by chunk. Nodes are only
+ *       visited if a dispose function was set.
  * @param tree Pointer to a red-black tree.
  */
 
 void rbtree_destroy(rb_tree * tree);
 
+/**
+ * @brief Free a red-black tree incrementally
+ *
+ * Free at most budget nodes per call, so that large trees can be destroyed
+ * across several iterations of an event loop without long pauses. Once this
+ * function has been called, the tree must not be used except to call it
+ * again or to call rbtree_destroy, which frees the rest at once.
+ *
+ * Pooled trees without a dispose function do not visit nodes, and are
+ * freed in a single call.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param budget Maximum number of nodes to free. It must not be 0.
+ * @retval 1 The tree is destroyed.
+ * @retval 0 Some nodes remain. Call this function again.
+ */
+
+int rbtree_destroy_step(rb_tree * tree, unsigned budget);
+
 /**
  * @brief Set free function to dispose elements
  *
@@ -74,6 +421,106 @@ void rbtree_destroy(rb_tree * tree);
 
 void rbtree_set_dispose(rb_tree * tree, void (*dispose)(void *));
 
+/**
+ * @brief Set the key comparison function
+ *
+ * Keys remain null-terminated strings, ordered by compare instead of strcmp.
+ * This must be called while the tree is empty. rbtree_init_with_compare
+ * creates a tree with a comparison function in one step.
+ *
+ * @param tree Pointer to an empty red-black tree.
+ * @param compare Pointer to a function that returns a negative, zero or
+ *                positive value if the first key is lower than, equal to or
+ *                greater than the second one.
+ * @retval 0 The comparison function was set.
+ * @retval -1 compare is NULL, or the tree is not empty or has an image. The
+ *            tree is not modified.
+ */
+
+int rbtree_set_compare(rb_tree * tree, int (*compare)(const char *, const char *));
+
+/**
+ * @brief Set the key type
+ *
+ * Fixed-size keys are stored in the node and compared without calling a
+ * function. The whole rbtree_* interface keeps working, with keys passed as
+ * pointers to their bytes (see RB_U64). Copies returned by rbtree_keys and
+ * rbtree_range hold exactly size bytes. This must be called while the tree
+ * is empty.
+ *
+ * @param tree Pointer to an empty red-black tree.
+ * @param type Key type. Use rbtree_set_compare for RB_KEY_CUSTOM.
+ * @param size Key size in bytes, for RB_KEY_BINARY. Ignored otherwise.
+ * @retval 0 The key type was set.
+ * @retval -1 The type is unknown or RB_KEY_CUSTOM, the size is zero for
+ *            RB_KEY_BINARY, or the tree is not empty or has an image. The
+ *            tree is not modified.
+ */
+
+int rbtree_set_key_type(rb_tree * tree, rb_key_type type, size_t size);
+
+/**
+ * @brief Make a tree safe for concurrent access
+ *
+ * Add a reader-writer lock to the tree: functions that only read the tree run
+ * in parallel, and functions that modify it run exclusively. This must be
+ * called before the tree is shared between threads.
+ *
+ * Keys and values returned by reference (e.g. rbtree_get, rbtree_minimum) may
+ * be freed by a concurrent deletion as soon as the function returns. Hold the
+ * read lock while using them, or while iterating.
+ *
+ * @param tree Pointer to a red-black tree.
+ */
+
+void rbtree_set_concurrent(rb_tree * tree);
+
+/**
+ * @brief Start searches from the last accessed node
+ *
+ * Add a finger to the tree: a hint (see rb_hint) that rbtree_get,
+ * rbtree_insert, rbtree_upsert, rbtree_insert_or_get, rbtree_replace and
+ * rbtree_delete use and update, so that runs of nearby keys are cheap.
+ *
+ * Concurrent trees ignore the finger, since lookups only hold a read lock.
+ * Use a hint per thread with rbtree_get_hint instead.
+ *
+ * @param tree Pointer to a red-black tree.
+ */
+
+void rbtree_set_finger(rb_tree * tree);
+
+/**
+ * @brief Take the tree lock for reading
+ *
+ * Other read functions may be called while holding the read lock. This is a
+ * no-op if the tree is not concurrent.
+ *
+ * @param tree Pointer to a red-black tree.
+ */
+
+void rbtree_rdlock(const rb_tree * tree);
+
+/**
+ * @brief Take the tree lock for writing
+ *
+ * Tree functions must not be called while holding the write lock, as they
+ * would try to lock the tree again. This is a no-op if the tree is not
+ * concurrent.
+ *
+ * @param tree Pointer to a red-black tree.
+ */
+
+void rbtree_wrlock(rb_tree * tree);
+
+/**
+ * @brief Release the tree lock
+ *
+ * @param tree Pointer to a red-black tree.
+ */
+
+void rbtree_unlock(const rb_tree * tree);
+
 /**
  * @brief Insert a key-value in the tree
  *
@@ -86,6 +533,70 @@ void rbtree_set_dispose(rb_tree * tree, void (*dispose)(void *));
 
 void * rbtree_insert(rb_tree * tree, const char * key, void * value);
 
+/**
+ * @brief Insert a key-value in the tree, starting from a hint
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key, used for ordering.
+ * @param value Data value.
+ * @param hint Pointer to a hint, that is set to the node of key.
+ * @return Pointer to value, on success.
+ * @retval NULL Key already exists in the tree.
+ */
+
+void * rbtree_insert_hint(rb_tree * tree, const char * key, void * value, rb_hint * hint);
+
+/**
+ * @brief Insert or update a key-value
+ *
+ * Search the key once: update its value if found, or insert it otherwise.
+ * A node is allocated only when the key is inserted.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key.
+ * @param value Data value.
+ * @post If the key existed, its old value is disposed if a dispose function
+ *       was defined (unless it is value itself).
+ * @return Pointer to value.
+ */
+
+void * rbtree_upsert(rb_tree * tree, const char * key, void * value);
+
+/**
+ * @brief Get the value slot of a key, inserting the key if missing
+ *
+ * Search the key once. If it is not in the tree, insert it with a NULL value.
+ * The caller may then read or write the value through the returned slot,
+ * which remains valid until the key is deleted. On concurrent trees, the
+ * slot is not protected after this function returns: serialize its use with
+ * other writers.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key.
+ * @param[out] inserted If not NULL, set to 1 if the key was inserted, or 0 if
+ *             it already existed.
+ * @return Pointer to the value slot of key.
+ */
+
+void ** rbtree_insert_or_get(rb_tree * tree, const char * key, int * inserted);
+
+/**
+ * @brief Insert a batch of key-values in the tree
+ *
+ * The batch is sorted, and then every search starts from the previously
+ * inserted node instead of the root. Keys that already exist in the tree are
+ * skipped, and for keys repeated in the batch only the first occurrence is
+ * inserted. Values of skipped keys are not disposed.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param keys Array of n keys, in any order.
+ * @param values Array of n values, or NULL to set all values to NULL.
+ * @param n Number of elements.
+ * @return Number of elements inserted.
+ */
+
+unsigned rbtree_insert_batch(rb_tree * tree, char * const * keys, void * const * values, unsigned n);
+
 /**
  * @brief Update the value of an existing key
  *
@@ -110,6 +621,18 @@ void * rbtree_replace(rb_tree * tree, const char * key, void * value);
 
 void * rbtree_get(const rb_tree * tree, const char * key);
 
+/**
+ * @brief Retrieve a value from the tree, starting from a hint
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key (search criteria).
+ * @param hint Pointer to a hint, that is set to the node of key if found.
+ * @return Pointer to data value, if found.
+ * @retval NULL Key not found.
+ */
+
+void * rbtree_get_hint(const rb_tree * tree, const char * key, rb_hint * hint);
+
 /**
  * @brief Remove a value from the tree
  *
@@ -121,9 +644,27 @@ void * rbtree_get(const rb_tree * tree, const char * key);
 
 int rbtree_delete(rb_tree * tree, const char * key);
 
+/**
+ * @brief Remove all the values in a range of keys
+ *
+ * The range is detached as a whole: the cost is O(log n) plus the number of
+ * deleted elements, rather than a search and a rebalancing per key. In
+ * builds with RBTREE_STATS, the path length is recomputed, which takes
+ * linear time.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param min Lowest key of the range (included).
+ * @param max Highest key of the range (included).
+ * @return Number of deleted elements.
+ */
+
+unsigned rbtree_delete_range(rb_tree * tree, const char * min, const char * max);
+
 /**
  * @brief Get the minimum key in the tree
  *
+ * This function runs in constant time.
+ *
  * @param tree Pointer to a red-black tree.
  * @return Minimum key in the tree.
  * @retval NULL The tree is empty.
@@ -134,6 +675,8 @@ const char * rbtree_minimum(const rb_tree * tree);
 /**
  * @brief Get the maximum key in the tree
  *
+ * This function runs in constant time.
+ *
  * @param tree Pointer to a red-black tree.
  * @return Maximum key in the tree.
  * @retval NULL The tree is empty.
@@ -141,6 +684,34 @@ const char * rbtree_minimum(const rb_tree * tree);
 
 const char * rbtree_maximum(const rb_tree * tree);
 
+/**
+ * @brief Remove the element with the minimum key
+ *
+ * The tree keeps a pointer to its leftmost node, so no search is needed.
+ * Rebalancing takes amortized constant time, and only the subtree sizes
+ * along the path to the root are updated.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param[out] value Set to the value, that is not disposed, if not NULL.
+ * @return Copy of the minimum key, to be freed with free().
+ * @retval NULL The tree is empty.
+ */
+
+char * rbtree_pop_min(rb_tree * tree, void ** value);
+
+/**
+ * @brief Remove the element with the maximum key
+ *
+ * See rbtree_pop_min.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param[out] value Set to the value, that is not disposed, if not NULL.
+ * @return Copy of the maximum key, to be freed with free().
+ * @retval NULL The tree is empty.
+ */
+
+char * rbtree_pop_max(rb_tree * tree, void ** value);
+
 /**
  * @brief Get all the keys in the tree
  *
@@ -166,6 +737,134 @@ char ** rbtree_keys(const rb_tree * tree);
 
 char ** rbtree_range(const rb_tree * tree, const char * min, const char * max);
 
+/**
+ * @brief Visit the elements of the tree within a range
+ *
+ * Call fn for every key-value pair in the closed range [min, max], in key
+ * order, without copying keys. The visit stops as soon as fn returns nonzero.
+ * fn must not modify the tree.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param min Minimum key.
+ * @param max Maximum key.
+ * @param fn Pointer to the visitor function.
+ * @param ctx Opaque pointer that is passed to fn.
+ * @return Last value returned by fn.
+ * @retval 0 All the elements in the range were visited.
+ */
+
+int rbtree_foreach_range(const rb_tree * tree, const char * min, const char * max, int (*fn)(const char * key, void * value, void * ctx), void * ctx);
+
+/**
+ * @brief Visit all the elements of the tree with a number of threads
+ *
+ * The elements are split into runs of consecutive keys, about eight per
+ * thread, that threads take as they become idle. Each run is visited in key
+ * order, but runs are visited concurrently and in no particular order.
+ *
+ * fn must be thread-safe and must not modify the tree. When it returns
+ * nonzero, the threads stop taking elements, although other calls to fn may
+ * be in progress.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param fn Pointer to the visitor function.
+ * @param ctx Opaque pointer that is passed to fn.
+ * @param nthreads Number of threads, including the calling one, or 0 to use
+ *                 one per online processor.
+ * @return First nonzero value returned by fn.
+ * @retval 0 All the elements were visited.
+ */
+
+int rbtree_foreach_parallel(const rb_tree * tree, int (*fn)(const char * key, void * value, void * ctx), void * ctx, unsigned nthreads);
+
+/**
+ * @brief Fold all the elements of the tree with a number of threads
+ *
+ * Every run of consecutive keys (see rbtree_foreach_parallel) is folded by
+ * map, starting from a NULL accumulator. Then the results of the runs are
+ * combined by reduce, in key order, by the calling thread. So reduce must be
+ * associative, but it does not need to be commutative.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param map Pointer to a function that adds an element to an accumulator,
+ *            and returns the new accumulator. It must be thread-safe.
+ * @param reduce Pointer to a function that combines the accumulators of two
+ *               adjacent runs, left before right, and returns the result.
+ * @param ctx Opaque pointer that is passed to map and reduce.
+ * @param nthreads Number of threads, including the calling one, or 0 to use
+ *                 one per online processor.
+ * @return Accumulator of the whole tree.
+ * @retval NULL The tree is empty.
+ */
+
+void * rbtree_map_reduce(const rb_tree * tree, void * (*map)(const char * key, void * value, void * acc, void * ctx), void * (*reduce)(void * left, void * right, void * ctx), void * ctx, unsigned nthreads);
+
+/**
+ * @brief Get the union of two trees
+ *
+ * Both trees are merged in a single pass. Keys in both trees take the value
+ * from a.
+ *
+ * @param a Pointer to a red-black tree.
+ * @param b Pointer to a red-black tree with the same key type as a.
+ * @return Pointer to a new pooled tree. It shares the values with a and b,
+ *         and has no dispose function.
+ */
+
+rb_tree * rbtree_union(const rb_tree * a, const rb_tree * b);
+
+/**
+ * @brief Get the intersection of two trees
+ *
+ * The smaller tree is walked, and its keys are searched in the larger one
+ * from the previous match, so this runs in O(m log(n / m + 1)) for trees of
+ * sizes m <= n. The walk is split as in rbtree_map_reduce.
+ *
+ * @param a Pointer to a red-black tree.
+ * @param b Pointer to a red-black tree with the same key type as a.
+ * @param nthreads Number of threads, including the calling one, or 0 to use
+ *                 one per online processor.
+ * @return Pointer to a new pooled tree with the keys in both trees and the
+ *         values from a. It shares the values with a, and has no dispose
+ *         function.
+ */
+
+rb_tree * rbtree_intersection(const rb_tree * a, const rb_tree * b, unsigned nthreads);
+
+/**
+ * @brief Get the difference of two trees
+ *
+ * a is walked, and its keys are searched in b as in rbtree_intersection.
+ *
+ * @param a Pointer to a red-black tree.
+ * @param b Pointer to a red-black tree with the same key type as a.
+ * @param nthreads Number of threads, including the calling one, or 0 to use
+ *                 one per online processor.
+ * @return Pointer to a new pooled tree with the keys in a that are not in b.
+ *         It shares the values with a, and has no dispose function.
+ */
+
+rb_tree * rbtree_difference(const rb_tree * a, const rb_tree * b, unsigned nthreads);
+
+/**
+ * @brief Report the changes between two trees
+ *
+ * Both trees are merged in a single pass, and fn is called for every key
+ * that is only in one of them, or whose values differ, in key order.
+ *
+ * @param old Pointer to a red-black tree.
+ * @param new Pointer to a red-black tree with the same key type as old.
+ * @param equal Pointer to a function that compares two values, returning
+ *              nonzero if they are equal, or NULL to compare the pointers.
+ * @param fn Pointer to the function that receives a change. The missing
+ *           value of added and removed keys is NULL.
+ * @param ctx Opaque pointer that is passed to fn.
+ * @return First nonzero value returned by fn, that stops the comparison.
+ * @retval 0 All the changes were reported.
+ */
+
+int rbtree_diff(const rb_tree * old, const rb_tree * new, int (*equal)(const void * a, const void * b), int (*fn)(rb_diff change, const char * key, void * old_value, void * new_value, void * ctx), void * ctx);
+
 /**
  * @brief Get the black depth of a tree
  *
@@ -184,12 +883,78 @@ int rbtree_black_depth(const rb_tree * tree);
 /**
  * @brief Get the size of the tree
  *
+ * This function runs in constant time.
+ *
  * @param tree Pointer to a red-black tree.
  * @return unsigned Number of elements in the tree.
  */
 
 unsigned rbtree_size(const rb_tree * tree);
 
+/**
+ * @brief Get the rank of a key
+ *
+ * The rank is the number of keys in the tree that are lower than the given
+ * key. If the key is in the tree, this is its zero-based position.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param key Data key. It does not need to be in the tree.
+ * @return Number of keys lower than key.
+ */
+
+unsigned rbtree_rank(const rb_tree * tree, const char * key);
+
+/**
+ * @brief Get the key at a given position
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param index Zero-based position, in key order.
+ * @return Key at that position.
+ * @retval NULL index is out of range.
+ */
+
+const char * rbtree_select(const rb_tree * tree, unsigned index);
+
+/**
+ * @brief Count the keys within a range
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param min Minimum key.
+ * @param max Maximum key.
+ * @return Number of keys in the closed range [min, max].
+ */
+
+unsigned rbtree_count_range(const rb_tree * tree, const char * min, const char * max);
+
+/**
+ * @brief Get tree statistics
+ *
+ * Structural figures are derived without walking the whole tree: the black
+ * depth is counted along the leftmost path, in O(log n), and is not checked
+ * against other paths (see rbtree_black_depth). The height is reported as
+ * the bound that the red-black invariants guarantee, twice the black depth.
+ * The average depth is the path length over the size.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @return Counters and structural figures.
+ */
+
+rb_stats rbtree_stats(const rb_tree * tree);
+
+/**
+ * @brief Compute the path length of a tree
+ *
+ * Debug accessor: walks the whole tree, in O(n), to sum the depths of all
+ * nodes, with the root at depth 0. Unlike rb_stats.path_length, it is
+ * available without RBTREE_STATS, so tests can check the maintained figure
+ * against it.
+ *
+ * @param tree Pointer to a red-black tree.
+ * @return Sum of the depths of all nodes.
+ */
+
+uint64_t rbtree_path_length(const rb_tree * tree);
+
 /**
  * @brief Check whether the tree is empty.
  *
@@ -199,4 +964,77 @@ unsigned rbtree_size(const rb_tree * tree);
  */
 int rbtree_empty(const rb_tree * tree);
 
+/**
+ * @brief Move an iterator to the minimum key
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param iter Pointer to an iterator.
+ * @return Minimum key.
+ * @retval NULL The tree is empty.
+ */
+
+const char * rbtree_iter_first(const rb_tree * tree, rb_iter * iter);
+
+/**
+ * @brief Move an iterator to the maximum key
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param iter Pointer to an iterator.
+ * @return Maximum key.
+ * @retval NULL The tree is empty.
+ */
+
+const char * rbtree_iter_last(const rb_tree * tree, rb_iter * iter);
+
+/**
+ * @brief Move an iterator to the first key not lower than a key
+ *
+ * @param tree Pointer to a red-black tree.
+ * @param iter Pointer to an iterator.
+ * @param key Data key. It does not need to be in the tree.
+ * @return Lowest key greater than or equal to key.
+ * @retval NULL All keys in the tree are lower than key.
+ */
+
+const char * rbtree_iter_seek(const rb_tree * tree, rb_iter * iter, const char * key);
+
+/**
+ * @brief Move an iterator to the next key
+ *
+ * @param iter Pointer to a valid iterator.
+ * @return Next key.
+ * @retval NULL The iterator was at the maximum key. It is no longer valid.
+ */
+
+const char * rbtree_iter_next(rb_iter * iter);
+
+/**
+ * @brief Move an iterator to the previous key
+ *
+ * @param iter Pointer to a valid iterator.
+ * @return Previous key.
+ * @retval NULL The iterator was at the minimum key. It is no longer valid.
+ */
+
+const char * rbtree_iter_prev(rb_iter * iter);
+
+/**
+ * @brief Get the key at an iterator
+ *
+ * @param iter Pointer to an iterator.
+ * @return Current key, owned by the tree.
+ * @retval NULL The iterator is past the end.
+ */
+
+const char * rbtree_iter_key(const rb_iter * iter);
+
+/**
+ * @brief Get the value at an iterator
+ *
+ * @param iter Pointer to a valid iterator.
+ * @return Current value.
+ */
+
+void * rbtree_iter_value(const rb_iter * iter);
+
 #endif